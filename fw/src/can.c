@@ -17,73 +17,339 @@
 #include "ustdlib.h"
 
 #include "can.h"
+#include "filter.h"
+#include "timestamp.h"
 #include "usb.h"
 
+// receive objects, CAN_RX_OBJ to CAN_RX_OBJ + CAN_RX_OBJECTS - 1. with no
+// filters they hold a single FIFO of CAN_RX_FIFO_LEN objects accepting
+// everything. otherwise they are split evenly between the filters, each
+// filter getting its own FIFO of up to CAN_RX_FIFO_LEN objects. the
+// controller fills the lowest free object of a FIFO first, so a burst of
+// frames is held until the ISR gets to it rather than overwriting a single
+// object.
 #define CAN_RX_OBJ 1
+#define CAN_RX_OBJECTS CAN_MAX_FILTERS
+#ifndef CAN_RX_FIFO_LEN
+#define CAN_RX_FIFO_LEN 16
+#endif
+#define CAN_RX_OBJ_MASK (((1 << CAN_RX_OBJECTS) - 1) << (CAN_RX_OBJ - 1))
 
-void (*can_callback)(uint32_t, tCANMsgObject*);
+// transmit objects, CAN_TX_OBJ to 32. frames waiting for a free object are
+// kept in a queue sorted by bus priority, and each transmit complete
+// interrupt loads the next one.
+//
+// the controller sends pending objects lowest object number first, not
+// lowest id first. so a frame is only loaded into a free object if every
+// pending object below it has a higher priority and every pending object
+// above it a lower priority. otherwise it waits in the queue, which keeps
+// the frames in the hardware in priority order.
+#define CAN_TX_OBJ (CAN_RX_OBJ + CAN_RX_OBJECTS)
+#define CAN_TX_OBJECTS (32 - CAN_TX_OBJ + 1)
+#define CAN_TX_QUEUE_LEN 32
+
+#define CAN_BUS_COUNT 2
+
+// per bus transmit state
+typedef struct {
+    // frames waiting for an object, highest priority first
+    can_frame_t queue[CAN_TX_QUEUE_LEN];
+    uint32_t count;
+    // bit n set if object CAN_TX_OBJ + n holds a pending frame
+    uint32_t busy;
+    // priority key of the frame in each object
+    uint32_t keys[CAN_TX_OBJECTS];
+} can_tx_t;
+
+void (*can_callback)(uint32_t, can_frame_t*);
+
+// per bus counters, indexed by bus number - CAN_BUS_1
+static can_stats_t can_stats[CAN_BUS_COUNT];
+
+// per bus transmit state, indexed by bus number - CAN_BUS_1
+static can_tx_t can_tx[CAN_BUS_COUNT];
+
+// per bus acceptance filters, indexed by bus number - CAN_BUS_1
+static can_filter_t can_filters[CAN_BUS_COUNT][CAN_MAX_FILTERS];
+static uint32_t can_filter_count[CAN_BUS_COUNT];
 
 // convert bus number to peripherial base
 static uint32_t get_base(uint32_t bus) {
-    /* TODO: enable 2nd can bus
     if (bus == CAN_BUS_2) {
         return CAN1_BASE;
     } else {
         return CAN0_BASE;
-    }*/
-    return CAN0_BASE;
+    }
+}
+
+// key ordering frames by bus priority, lower wins arbitration. the fields
+// are in the order they are sent: the first 11 id bits, IDE, the other 18
+// id bits of an extended id, then RTR.
+static uint32_t priority_key(can_frame_t *frame) {
+    uint32_t key;
+
+    if (frame->flags & CAN_FRAME_EXTENDED) {
+        key = ((frame->id >> 18) << 19) | (1 << 18) | (frame->id & 0x3FFFF);
+    } else {
+        key = frame->id << 19;
+    }
+
+    return (key << 1) | ((frame->flags & CAN_FRAME_REMOTE) ? 1 : 0);
 }
 
-void can0_rx_isr() {
+// find a free transmit object that keeps the pending objects in priority
+// order with a frame of priority key added, -1 if there isn't one
+static int32_t find_tx_slot(can_tx_t *tx, uint32_t key) {
+    int32_t slot;
+    int32_t i;
+    bool ordered;
+
+    for (slot = 0; slot < CAN_TX_OBJECTS; slot++) {
+        if (tx->busy & (1 << slot)) {
+            continue;
+        }
+        ordered = true;
+        for (i = 0; i < CAN_TX_OBJECTS; i++) {
+            if (!(tx->busy & (1 << i))) {
+                continue;
+            }
+            if ((i < slot && tx->keys[i] > key) ||
+                (i > slot && tx->keys[i] < key)) {
+                ordered = false;
+                break;
+            }
+        }
+        if (ordered) {
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+// move queued frames into free transmit objects, interrupts must be off
+//
+// CANMessageSet goes through the IF1 interface registers. IF1 is shared
+// with tx_complete, load_filters and can_send_frame, which run from the
+// CAN ISRs, the USB ISR and the timer ISRs. that is only safe because
+// every interrupt is left at the same priority, so none of them can
+// preempt another part way through an IF1 transfer. raising any of their
+// priorities needs IF1 use guarded.
+static void tx_fill(uint32_t bus) {
+    can_tx_t *tx = &can_tx[bus - CAN_BUS_1];
+    tCANMsgObject tx_msg;
+    can_frame_t *frame;
+    uint32_t key;
+    int32_t slot;
+    uint32_t i;
+
+    while (tx->count > 0) {
+        frame = &tx->queue[0];
+        key = priority_key(frame);
+        slot = find_tx_slot(tx, key);
+        if (slot < 0) {
+            return;
+        }
+
+        tx_msg.ui32MsgID = frame->id;
+        tx_msg.ui32MsgLen = frame->len;
+        tx_msg.pui8MsgData = frame->data;
+        tx_msg.ui32Flags = MSG_OBJ_TX_INT_ENABLE;
+        if (frame->flags & CAN_FRAME_EXTENDED) {
+            tx_msg.ui32Flags |= MSG_OBJ_EXTENDED_ID;
+        }
+        CANMessageSet(get_base(bus), CAN_TX_OBJ + slot, &tx_msg,
+                      (frame->flags & CAN_FRAME_REMOTE) ?
+                      MSG_OBJ_TYPE_TX_REMOTE : MSG_OBJ_TYPE_TX);
+        tx->busy |= 1 << slot;
+        tx->keys[slot] = key;
+
+        tx->count--;
+        for (i = 0; i < tx->count; i++) {
+            tx->queue[i] = tx->queue[i + 1];
+        }
+    }
+}
+
+// free the objects of frames that have been sent and refill them
+static void tx_complete(uint32_t bus) {
+    uint32_t base = get_base(bus);
+    can_tx_t *tx = &can_tx[bus - CAN_BUS_1];
+    uint32_t requested;
+    uint32_t done;
+    uint32_t slot;
+
+    // an object's TXRQST bit clears once its frame is sent
+    requested = CANStatusGet(base, CAN_STS_TXREQUEST);
+    done = tx->busy & ~(requested >> (CAN_TX_OBJ - 1));
+    while (done) {
+        slot = __builtin_ctz(done);
+        done &= done - 1;
+
+        CANIntClear(base, CAN_TX_OBJ + slot);
+        tx->busy &= ~(1 << slot);
+        can_stats[bus - CAN_BUS_1].tx++;
+    }
+
+    tx_fill(bus);
+}
+
+// read all received frames from a bus and handle sent frames, shared by
+// both bus ISRs
+//
+// CANMessageGet reads through IF2, but tx_complete and tx_fill use IF1,
+// which is shared with the other ISRs, see tx_fill
+static void can_isr(uint32_t bus) {
+    uint32_t base = get_base(bus);
+    can_stats_t *stats = &can_stats[bus - CAN_BUS_1];
     tCANMsgObject received_msg;
-    uint8_t data[8];
-    uint32_t status;
+    can_frame_t frame;
+    uint64_t timestamp;
+    uint32_t pending;
+    uint32_t obj;
+    uint32_t batch = 0;
 
-    IntMasterDisable();
+    // sample the time first, as close to the frame's arrival as possible
+    timestamp = timestamp_get();
 
-    status = CANIntStatus(CAN0_BASE, CAN_INT_STS_CAUSE);
-    if (status == CAN_INT_INTID_STATUS) {
-        // status interrupt, do nothing for now
-        IntMasterEnable();
-        return;
+    if (CANIntStatus(base, CAN_INT_STS_CAUSE) == CAN_INT_INTID_STATUS) {
+        // status interrupt, reading the status register clears it
+        CANStatusGet(base, CAN_STS_CONTROL);
+    }
+
+    // read the data straight into the frame
+    received_msg.pui8MsgData = frame.data;
+
+    // read every object holding a new frame in one pass instead of taking an
+    // interrupt per frame. objects are read lowest first, which is both
+    // priority order and the order the FIFO was filled in. frames that
+    // arrive while draining are picked up by the next pass.
+    while ((pending = CANStatusGet(base, CAN_STS_NEWDAT) &
+                      CAN_RX_OBJ_MASK) != 0) {
+        if (batch > 0) {
+            // these frames arrived while the previous pass was being read
+            timestamp = timestamp_get();
+        }
+
+        while (pending) {
+            // bit 0 of the NEWDAT bitmap is message object 1
+            obj = __builtin_ctz(pending) + 1;
+            pending &= pending - 1;
+
+            // get the message and clear the flag
+            CANMessageGet(base, obj, &received_msg, true);
+            batch++;
+            if (received_msg.ui32Flags & MSG_OBJ_DATA_LOST) {
+                // the object was overwritten before it was read
+                stats->data_lost++;
+            }
+
+            frame.timestamp = timestamp;
+            frame.id = received_msg.ui32MsgID;
+            frame.len = received_msg.ui32MsgLen;
+            frame.flags = 0;
+            if (received_msg.ui32Flags & MSG_OBJ_EXTENDED_ID) {
+                frame.flags |= CAN_FRAME_EXTENDED;
+            }
+            can_callback(bus, &frame);
+        }
     }
 
-    received_msg.pui8MsgData = (uint8_t *) &data;
-    // get the message and clear the flag
-    CANMessageGet(CAN0_BASE, status, &received_msg, true);
-    can_callback(CAN_BUS_1, &received_msg);
+    // the ISR may have been called by a transmit complete interrupt
+    if (can_tx[bus - CAN_BUS_1].busy) {
+        tx_complete(bus);
+    }
 
-    IntMasterEnable();
+    stats->rx += batch;
+    stats->interrupts++;
+    if (batch > stats->max_batch) {
+        stats->max_batch = batch;
+    }
 }
 
-void can_init(void (*can_callback_ptr)(uint32_t, tCANMsgObject*)) {
-    tCANMsgObject can0_rx_msg;
-    int can_obj_count ;
+void can0_isr() {
+    can_isr(CAN_BUS_1);
+}
 
-    // wait here if the peripherial isn't enabled
-    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_CAN0));
+void can1_isr() {
+    can_isr(CAN_BUS_2);
+}
 
-    // initialize CAN0
-    CANInit(CAN0_BASE);
+// program count objects starting at obj as a FIFO accepting frames that
+// match filter
+static void set_rx_fifo(uint32_t base, uint32_t obj, uint32_t count,
+                        can_filter_t *filter) {
+    tCANMsgObject rx_msg;
+    uint32_t flags;
+    uint32_t last = obj + count - 1;
 
-    // accept all messages by default
-    can0_rx_msg.ui32MsgID = 0;
-    can0_rx_msg.ui32MsgIDMask = 0;
+    rx_msg.ui32MsgID = filter->id;
+    rx_msg.ui32MsgIDMask = filter->mask;
+
+    flags = MSG_OBJ_RX_INT_ENABLE | MSG_OBJ_USE_ID_FILTER;
+    if (filter->flags & CAN_FILTER_EXTENDED) {
+        flags |= MSG_OBJ_EXTENDED_ID;
+    }
+    if (filter->flags & CAN_FILTER_MATCH_IDE) {
+        // only accept frames with the same id type as the filter
+        flags |= MSG_OBJ_USE_EXT_FILTER;
+    }
 
-    /* TODO: determine if FIFO actually helps!
-    // set up FIFO
-    can0_rx_msg.ui32Flags = MSG_OBJ_RX_INT_ENABLE | MSG_OBJ_USE_ID_FILTER |
-                            MSG_OBJ_FIFO;
-    for (can_obj_count = 1; can_obj_count < CAN_RX_OBJECTS; can_obj_count++) {
-        CANMessageSet(CAN0_BASE, can_obj_count, &can0_rx_msg, MSG_OBJ_TYPE_RX);
+    // every object but the last is chained to the next
+    rx_msg.ui32Flags = flags | MSG_OBJ_FIFO;
+    for (; obj < last; obj++) {
+        CANMessageSet(base, obj, &rx_msg, MSG_OBJ_TYPE_RX);
     }
-    */
 
     // last in FIFO, clear FIFO flag
-    can0_rx_msg.ui32Flags = MSG_OBJ_RX_INT_ENABLE | MSG_OBJ_USE_ID_FILTER;
-    CANMessageSet(CAN0_BASE, CAN_RX_OBJ, &can0_rx_msg, MSG_OBJ_TYPE_RX);
+    rx_msg.ui32Flags = flags;
+    CANMessageSet(base, obj, &rx_msg, MSG_OBJ_TYPE_RX);
+}
 
-    CANIntRegister(CAN0_BASE, can0_rx_isr);
+// reprogram all receive objects of a bus from its filter table
+static void load_filters(uint32_t bus) {
+    uint32_t base = get_base(bus);
+    uint32_t count = can_filter_count[bus - CAN_BUS_1];
+    uint32_t fifo_len;
+    uint32_t obj;
+    uint32_t i;
+    // used when there are no filters
+    can_filter_t accept_all = {0, 0, 0};
+
+    for (obj = CAN_RX_OBJ; obj < CAN_RX_OBJ + CAN_RX_OBJECTS; obj++) {
+        CANMessageClear(base, obj);
+    }
+
+    if (count == 0) {
+        set_rx_fifo(base, CAN_RX_OBJ, CAN_RX_FIFO_LEN, &accept_all);
+        return;
+    }
+
+    fifo_len = CAN_RX_OBJECTS / count;
+    if (fifo_len > CAN_RX_FIFO_LEN) {
+        fifo_len = CAN_RX_FIFO_LEN;
+    }
+    for (i = 0; i < count; i++) {
+        set_rx_fifo(base, CAN_RX_OBJ + i * fifo_len, fifo_len,
+                    &can_filters[bus - CAN_BUS_1][i]);
+    }
+}
+
+void can_init(void (*can_callback_ptr)(uint32_t, can_frame_t*)) {
+    // wait here if the peripherials aren't enabled
+    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_CAN0));
+    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_CAN1));
+
+    // initialize CAN0 and CAN1
+    CANInit(CAN0_BASE);
+    CANInit(CAN1_BASE);
+
+    // accept all messages by default
+    load_filters(CAN_BUS_1);
+    load_filters(CAN_BUS_2);
+
+    CANIntRegister(CAN0_BASE, can0_isr);
+    CANIntRegister(CAN1_BASE, can1_isr);
 
     // setup the callback
     can_callback = can_callback_ptr;
@@ -103,16 +369,115 @@ void can_set_rate(uint32_t bus, uint32_t rate) {
     CANBitRateSet(get_base(bus), SysCtlClockGet(), rate);
 }
 
-void can_set_filter(uint32_t bus, uint32_t id, uint32_t mask) {
-    tCANMsgObject rx_msg;
+// set the bit timing directly, in time quanta of brp clock cycles. tseg1
+// covers the propagation and phase 1 segments, driverlib also counts the
+// one quantum sync segment in it.
+void can_set_bit_timing(uint32_t bus, uint32_t brp, uint32_t tseg1,
+                        uint32_t tseg2, uint32_t sjw) {
+    tCANBitClkParms timing;
+
+    timing.ui32SyncPropPhase1Seg = tseg1 + 1;
+    timing.ui32Phase2Seg = tseg2;
+    timing.ui32SJW = sjw;
+    timing.ui32QuantumPrescaler = brp;
+    CANBitTimingSet(get_base(bus), &timing);
+}
 
-    rx_msg.ui32MsgID = id;
-    rx_msg.ui32MsgIDMask = mask;
-    rx_msg.ui32Flags = MSG_OBJ_RX_INT_ENABLE | MSG_OBJ_USE_ID_FILTER;
+// frequency of the clock the CAN controllers run from, in Hz
+uint32_t can_clock(void) {
+    return SysCtlClockGet();
+}
+
+// add an acceptance filter to a bus, false if the table is full
+bool can_filter_add(uint32_t bus, can_filter_t *filter) {
+    uint32_t *count = &can_filter_count[bus - CAN_BUS_1];
+
+    if (*count >= CAN_MAX_FILTERS) {
+        return false;
+    }
+    can_filters[bus - CAN_BUS_1][*count] = *filter;
+    (*count)++;
+    load_filters(bus);
 
-    CANMessageSet(get_base(bus), CAN_RX_OBJ, &rx_msg, MSG_OBJ_TYPE_RX);
+    return true;
 }
 
-void can_send(uint32_t bus, tCANMsgObject *msg_ptr) {
-    CANMessageSet(get_base(bus), 32, msg_ptr, MSG_OBJ_TYPE_TX);
+// remove the filter at index, later filters move down one place
+bool can_filter_remove(uint32_t bus, uint32_t index) {
+    can_filter_t *filters = can_filters[bus - CAN_BUS_1];
+    uint32_t *count = &can_filter_count[bus - CAN_BUS_1];
+
+    if (index >= *count) {
+        return false;
+    }
+    for ((*count)--; index < *count; index++) {
+        filters[index] = filters[index + 1];
+    }
+    load_filters(bus);
+
+    return true;
+}
+
+// remove all filters, accepting every frame
+void can_filter_clear(uint32_t bus) {
+    can_filter_count[bus - CAN_BUS_1] = 0;
+    load_filters(bus);
+}
+
+// get the filter at index, false if there isn't one
+bool can_filter_get(uint32_t bus, uint32_t index, can_filter_t *filter) {
+    if (index >= can_filter_count[bus - CAN_BUS_1]) {
+        return false;
+    }
+    *filter = can_filters[bus - CAN_BUS_1][index];
+
+    return true;
+}
+
+
+// get a copy of the counters for a bus
+void can_get_stats(uint32_t bus, can_stats_t *stats) {
+    *stats = can_stats[bus - CAN_BUS_1];
+    // the software filters are applied by the receive callback
+    stats->filtered = filter_rejected(bus);
+}
+
+// number of frames that can be queued on a bus before it is full
+uint32_t can_tx_space(uint32_t bus) {
+    return CAN_TX_QUEUE_LEN - can_tx[bus - CAN_BUS_1].count;
+}
+
+// queue a frame to be sent, false if the queue is full. may be called from
+// any context.
+bool can_send_frame(uint32_t bus, can_frame_t *frame) {
+    can_tx_t *tx = &can_tx[bus - CAN_BUS_1];
+    uint32_t key = priority_key(frame);
+    uint32_t i;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+
+    if (tx->count >= CAN_TX_QUEUE_LEN) {
+        can_stats[bus - CAN_BUS_1].tx_full++;
+        if (!ints_off) {
+            ROM_IntMasterEnable();
+        }
+        return false;
+    }
+
+    // insert after every frame of the same or higher priority, so frames
+    // with equal ids are sent in the order they were queued
+    for (i = tx->count; i > 0 && priority_key(&tx->queue[i - 1]) > key; i--) {
+        tx->queue[i] = tx->queue[i - 1];
+    }
+    tx->queue[i] = *frame;
+    tx->count++;
+
+    tx_fill(bus);
+
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return true;
 }
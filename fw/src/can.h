@@ -8,11 +8,77 @@ enum {
     CAN_BUS_2
 };
 
-void can_init(void (*)(uint32_t, tCANMsgObject*));
+// frame flags
+//
+// the id is a 29 bit extended id
+#define CAN_FRAME_EXTENDED 0x01
+// remote transmission request. the message objects don't record this for
+// received frames, so it is only used when sending.
+#define CAN_FRAME_REMOTE 0x02
+
+// largest standard and extended ids
+#define CAN_STD_ID_MASK 0x7FF
+#define CAN_EXT_ID_MASK 0x1FFFFFFF
+
+// a frame, copied out of the message object by value
+typedef struct {
+    // time the frame was read from the controller, in microseconds
+    uint64_t timestamp;
+    uint32_t id;
+    uint8_t len;
+    uint8_t flags;
+    uint8_t data[8];
+} can_frame_t;
+
+// maximum number of acceptance filters per bus, each one uses at least one
+// of the message objects reserved for receiving
+#define CAN_MAX_FILTERS 24
+
+// filter flags
+//
+// the filter's id and mask are 29 bit extended ids
+#define CAN_FILTER_EXTENDED 0x01
+// only accept frames with the filter's id type, standard or extended
+#define CAN_FILTER_MATCH_IDE 0x02
+
+// a hardware acceptance filter, frames are received if their id matches id
+// in every bit set in mask
+typedef struct {
+    uint32_t id;
+    uint32_t mask;
+    uint32_t flags;
+} can_filter_t;
+
+// receive counters, kept per bus
+typedef struct {
+    // frames read from the controller
+    uint32_t rx;
+    // frames overwritten in a message object before they could be read
+    uint32_t data_lost;
+    // receive interrupts taken, rx / interrupts is the average batch size
+    uint32_t interrupts;
+    // most frames read in a single interrupt
+    uint32_t max_batch;
+    // frames read but kept from the host by the software filters
+    uint32_t filtered;
+    // frames sent
+    uint32_t tx;
+    // frames not sent because the transmit queue was full
+    uint32_t tx_full;
+} can_stats_t;
+
+void can_init(void (*)(uint32_t, can_frame_t*));
 void can_enable(uint32_t);
 void can_disable(uint32_t);
 void can_set_rate(uint32_t, uint32_t);
-void can_set_filter(uint32_t, uint32_t, uint32_t);
-void can_send(uint32_t, tCANMsgObject*);
+void can_set_bit_timing(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+uint32_t can_clock(void);
+bool can_filter_add(uint32_t, can_filter_t*);
+bool can_filter_remove(uint32_t, uint32_t);
+void can_filter_clear(uint32_t);
+bool can_filter_get(uint32_t, uint32_t, can_filter_t*);
+bool can_send_frame(uint32_t, can_frame_t*);
+uint32_t can_tx_space(uint32_t);
+void can_get_stats(uint32_t, can_stats_t*);
 
 #endif
@@ -5,6 +5,7 @@
 #include "inc/hw_memmap.h"
 #include "inc/hw_types.h"
 #include "inc/hw_sysctl.h"
+#include "inc/hw_nvic.h"
 
 #include "driverlib/sysctl.h"
 #include "driverlib/can.h"
@@ -13,6 +14,16 @@
 
 #include "usb.h"
 #include "can.h"
+#include "filter.h"
+#include "gateway.h"
+#include "periodic.h"
+#include "stream.h"
+#include "isotp.h"
+#include "j1939.h"
+#include "responder.h"
+#include "query.h"
+#include "record.h"
+#include "encode.h"
 #include "commands.h"
 
 static int32_t get_bus(char *arg) {
@@ -24,6 +35,120 @@ static int32_t get_bus(char *arg) {
     return -1;
 }
 
+// parse a message id. ids above 0x7FF, or followed by an x, are extended.
+// an r after the id marks a remote frame.
+static bool get_id(char *arg, uint32_t *id, uint32_t *flags) {
+    const char *end;
+
+    *id = ustrtoul(arg, &end, 0);
+    *flags = 0;
+    if (end == arg) {
+        // no number given
+        return false;
+    }
+    if (*id > CAN_STD_ID_MASK) {
+        *flags |= CAN_FRAME_EXTENDED;
+    }
+
+    for (; *end != '\0'; end++) {
+        if (*end == 'x' || *end == 'X') {
+            *flags |= CAN_FRAME_EXTENDED;
+        } else if (*end == 'r' || *end == 'R') {
+            *flags |= CAN_FRAME_REMOTE;
+        } else {
+            return false;
+        }
+    }
+
+    return *id <= CAN_EXT_ID_MASK;
+}
+
+// convert a hex digit to its value, -1 if it isn't one
+static int32_t hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// parse up to 8 bytes written as pairs of hex digits, e.g. 0102FF. bytes
+// that aren't given are set to 0.
+static bool get_bytes(char *arg, uint8_t *bytes) {
+    int32_t high;
+    int32_t low;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        bytes[i] = 0;
+    }
+    for (i = 0; i < 8 && *arg != '\0'; i++) {
+        high = hex_digit(*(arg++));
+        low = hex_digit(*(arg++));
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        bytes[i] = (high << 4) | low;
+    }
+
+    // too many digits
+    return *arg == '\0';
+}
+
+// parse a frame written as <id>#<data>[@<gap>], like cansend. the id is 3
+// hex digits for a standard id or 8 for an extended one, the data is up to
+// 8 bytes as pairs of hex digits or R for a remote frame, and the optional
+// gap is the number of microseconds to wait before sending the frame.
+static bool get_frame(char *arg, can_frame_t *frame, uint32_t *gap) {
+    uint32_t digits = 0;
+    int32_t high;
+    int32_t low;
+
+    frame->id = 0;
+    frame->flags = 0;
+    frame->len = 0;
+    *gap = 0;
+
+    for (; *arg != '#'; arg++) {
+        high = hex_digit(*arg);
+        if (high < 0) {
+            return false;
+        }
+        frame->id = (frame->id << 4) | high;
+        digits++;
+    }
+    arg++;
+    if (digits == 8 && frame->id <= CAN_EXT_ID_MASK) {
+        frame->flags = CAN_FRAME_EXTENDED;
+    } else if (digits != 3 || frame->id > CAN_STD_ID_MASK) {
+        return false;
+    }
+
+    if (*arg == 'r' || *arg == 'R') {
+        frame->flags |= CAN_FRAME_REMOTE;
+        arg++;
+    } else {
+        while (*arg != '\0' && *arg != '@') {
+            high = hex_digit(*(arg++));
+            low = hex_digit(*(arg++));
+            if (high < 0 || low < 0 || frame->len >= 8) {
+                return false;
+            }
+            frame->data[frame->len] = (high << 4) | low;
+            frame->len++;
+        }
+    }
+
+    if (*arg == '@') {
+        *gap = ustrtoul(arg + 1, (const char **) &arg, 10);
+    }
+
+    return *arg == '\0';
+}
+
 uint32_t cmd_reset(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
         SysCtlReset();
         return CMD_ERROR_NONE;
@@ -33,7 +158,15 @@ uint32_t cmd_bus(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
     int32_t bus;
     uint32_t bit_rate;
     uint32_t id;
-    uint32_t mask;
+    uint32_t i;
+    uint32_t flags;
+    uint32_t count;
+    uint32_t extra;
+    int32_t result;
+    can_filter_t filter;
+    filter_payload_t payload;
+    can_stats_t stats;
+    char resp[MAX_RESP_SIZE];
 
     if (argc < 2) {
         // need at least bus and action args
@@ -68,15 +201,199 @@ uint32_t cmd_bus(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
         // filter: configure hardware filter
         if (ustrcasecmp("set", argv[3]) == 0) {
             // enable filter
-            id = ustrtoul(argv[4], NULL, 0);
-            mask = ustrtoul(argv[5], NULL, 0);
-            can_set_filter(bus, id, mask);
+            if (!get_id(argv[4], &filter.id, &flags)) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+            filter.mask = ustrtoul(argv[5], NULL, 0);
+            filter.flags = (flags & CAN_FRAME_EXTENDED) ?
+                           CAN_FILTER_EXTENDED : 0;
+            filter_ids_clear(bus);
+            can_filter_clear(bus);
+            can_filter_add(bus, &filter);
 
             return CMD_ERROR_NONE;
 
         } else if (ustrcasecmp("off", argv[3]) == 0) {
             // disable filter
-            can_set_filter(bus, 0, 0);
+            filter_ids_clear(bus);
+            can_filter_clear(bus);
+
+            return CMD_ERROR_NONE;
+
+        } else if (ustrcasecmp("add", argv[3]) == 0 && argc >= 5) {
+            // add a filter to the table, arg 6 optionally restricts it to
+            // standard or extended ids
+            if (!get_id(argv[4], &filter.id, &flags)) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+            filter.mask = ustrtoul(argv[5], NULL, 0);
+            filter.flags = (flags & CAN_FRAME_EXTENDED) ?
+                           CAN_FILTER_EXTENDED : 0;
+            if (argc >= 6) {
+                if (ustrcasecmp("std", argv[6]) == 0) {
+                    filter.flags = CAN_FILTER_MATCH_IDE;
+                } else if (ustrcasecmp("ext", argv[6]) == 0) {
+                    filter.flags = CAN_FILTER_EXTENDED | CAN_FILTER_MATCH_IDE;
+                } else {
+                    return CMD_ERROR_INVALID_ARG;
+                }
+            }
+            if (!can_filter_add(bus, &filter)) {
+                // table is full
+                return CMD_ERROR_INVALID_ARG;
+            }
+
+            return CMD_ERROR_NONE;
+
+        } else if (ustrcasecmp("del", argv[3]) == 0 && argc >= 4) {
+            // remove the filter at the index in arg 4
+            if (!can_filter_remove(bus, ustrtoul(argv[4], NULL, 0))) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+
+            return CMD_ERROR_NONE;
+
+        } else if (ustrcasecmp("list", argv[3]) == 0) {
+            // send one line per filter
+            for (i = 0; can_filter_get(bus, i, &filter); i++) {
+                usnprintf(resp, MAX_RESP_SIZE, "filter %u %08X %08X %s\r\n",
+                          i, filter.id, filter.mask,
+                          !(filter.flags & CAN_FILTER_MATCH_IDE) ? "any" :
+                          (filter.flags & CAN_FILTER_EXTENDED) ? "ext" : "std");
+                usb_send_str(resp);
+            }
+
+            return CMD_ERROR_NONE;
+
+        }
+    } else if (ustrcasecmp("stats", argv[2]) == 0) {
+        // stats: report the receive counters
+        can_get_stats(bus, &stats);
+        usnprintf(resp, MAX_RESP_SIZE,
+                  "stats: rx %u lost %u irq %u batch %u filtered %u "
+                  "tx %u full %u\r\n",
+                  stats.rx, stats.data_lost, stats.interrupts,
+                  stats.max_batch, stats.filtered, stats.tx, stats.tx_full);
+        usb_send_str(resp);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("payload", argv[2]) == 0) {
+        // payload: select frames of an id by length and data
+        if (ustrcasecmp("clear", argv[3]) == 0) {
+            filter_payload_clear(bus);
+
+            return CMD_ERROR_NONE;
+
+        } else if (ustrcasecmp("add", argv[3]) == 0 && argc >= 9) {
+            // args 4 - 9: id, mask, min length, max length, data, data mask
+            // arg 10: "change" to only pass frames whose data changed
+            // arg 11: bits to watch for changes, all bits if not given
+            if (!get_id(argv[4], &payload.id, &flags)) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+            payload.id_flags = flags & CAN_FRAME_EXTENDED;
+            payload.mask = ustrtoul(argv[5], NULL, 0);
+            payload.min_len = ustrtoul(argv[6], NULL, 0);
+            payload.max_len = ustrtoul(argv[7], NULL, 0);
+            payload.flags = 0;
+            if (!get_bytes(argv[8], payload.data) ||
+                !get_bytes(argv[9], payload.data_mask)) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+            if (argc >= 10) {
+                if (ustrcasecmp("change", argv[10]) != 0) {
+                    return CMD_ERROR_INVALID_ARG;
+                }
+                payload.flags |= FILTER_PAYLOAD_CHANGE;
+                if (argc >= 11) {
+                    if (!get_bytes(argv[11], payload.change_mask)) {
+                        return CMD_ERROR_INVALID_ARG;
+                    }
+                } else {
+                    for (i = 0; i < 8; i++) {
+                        payload.change_mask[i] = 0xFF;
+                    }
+                }
+            }
+            if (!filter_payload_add(bus, &payload)) {
+                // table is full
+                return CMD_ERROR_INVALID_ARG;
+            }
+
+            return CMD_ERROR_NONE;
+
+        }
+    } else if (ustrcasecmp("trigger", argv[2]) == 0) {
+        // trigger: drop frames until one matches
+        if (ustrcasecmp("off", argv[3]) == 0) {
+            filter_trigger_disarm(bus);
+
+            return CMD_ERROR_NONE;
+
+        } else if (argc >= 6) {
+            // args 3 - 6: id, mask, data, data mask
+            if (!get_id(argv[3], &payload.id, &flags)) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+            payload.id_flags = flags & CAN_FRAME_EXTENDED;
+            payload.mask = ustrtoul(argv[4], NULL, 0);
+            payload.min_len = 0;
+            payload.max_len = 8;
+            payload.flags = 0;
+            if (!get_bytes(argv[5], payload.data) ||
+                !get_bytes(argv[6], payload.data_mask)) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+            filter_trigger_arm(bus, &payload);
+
+            return CMD_ERROR_NONE;
+
+        }
+    } else if (ustrcasecmp("idlist", argv[2]) == 0) {
+        // idlist: receive exactly a list of ids
+        if (ustrcasecmp("clear", argv[3]) == 0) {
+            // empty the list and stop using it
+            filter_ids_clear(bus);
+            can_filter_clear(bus);
+
+            return CMD_ERROR_NONE;
+
+        } else if (ustrcasecmp("add", argv[3]) == 0 && argc >= 4) {
+            // add the ids in args 4 onwards to the list
+            for (i = 4; i <= argc; i++) {
+                if (!get_id(argv[i], &id, &flags) ||
+                    !filter_ids_add(bus, id, flags)) {
+                    // list is full
+                    return CMD_ERROR_INVALID_ARG;
+                }
+            }
+
+            return CMD_ERROR_NONE;
+
+        } else if (ustrcasecmp("apply", argv[3]) == 0) {
+            // check frames against the list in software only, keeping the
+            // current hardware filters
+            result = filter_ids_apply(bus);
+            if (result < 0) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+
+            return CMD_ERROR_NONE;
+
+        } else if (ustrcasecmp("load", argv[3]) == 0) {
+            // compute filters for the list and start using it. arg 4
+            // optionally limits the number of filters used, fewer filters
+            // leave more objects for each filter's FIFO.
+            count = CAN_MAX_FILTERS;
+            if (argc >= 4) {
+                count = ustrtoul(argv[4], NULL, 0);
+            }
+            result = filter_ids_load(bus, count, &extra);
+            if (result < 0) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+            usnprintf(resp, MAX_RESP_SIZE, "idlist: filters %d extra %u\r\n",
+                      result, extra);
+            usb_send_str(resp);
 
             return CMD_ERROR_NONE;
 
@@ -90,8 +407,8 @@ uint32_t cmd_bus(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
 uint32_t cmd_tx(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
     int i;
     int32_t bus;
-    uint8_t tx_data[8];
-    tCANMsgObject tx_msg;
+    uint32_t flags;
+    can_frame_t frame;
 
     if (argc < 3) {
         // need at least bus, msg id, and dlc
@@ -104,18 +421,685 @@ uint32_t cmd_tx(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
         return CMD_ERROR_INVALID_ARG;
     }
 
-    // arg 2: message id
-    tx_msg.ui32MsgID = ustrtoul(argv[2], NULL, 0);
+    // arg 2: message id, see get_id for extended and remote frames
+    if (!get_id(argv[2], &frame.id, &flags)) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+    frame.flags = flags;
     // arg 3: message length
-    tx_msg.ui32MsgLen = ustrtoul(argv[3], NULL, 0);
-    // arg 4 - 12
-    // TODO: length checking based on argc, message length, etc...
+    frame.len = ustrtoul(argv[3], NULL, 0);
+    if (frame.len > 8) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+    // arg 4 - 11: data, bytes that aren't given are 0
     for (i = 0; i < 8; i++) {
-        tx_data[i] = ustrtoul(argv[i+4], NULL, 0);
+        frame.data[i] = (i + 4 <= argc) ? ustrtoul(argv[i+4], NULL, 0) : 0;
+    }
+
+    if (!can_send_frame(bus, &frame)) {
+        // let the host back off until there is room
+        return CMD_ERROR_QUEUE_FULL;
+    }
+    return CMD_ERROR_NONE;
+}
+
+uint32_t cmd_txb(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    int i;
+    int32_t bus;
+    uint32_t gap;
+    uint32_t queued = 0;
+    can_frame_t frame;
+    char resp[MAX_RESP_SIZE];
+
+    if (argc < 2) {
+        // need at least bus and one frame
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 1: select bus
+    bus = get_bus(argv[1]);
+    if (bus < 0) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 2 on: frames, see get_frame. check them all first so a bad
+    // frame doesn't leave the batch half sent.
+    for (i = 2; i <= argc; i++) {
+        if (!get_frame(argv[i], &frame, &gap)) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+    }
+
+    for (i = 2; i <= argc; i++) {
+        get_frame(argv[i], &frame, &gap);
+        if (!stream_push(STREAM_TXB, bus, &frame, gap)) {
+            break;
+        }
+        queued++;
+    }
+    stream_start(STREAM_TXB);
+
+    // one reply for the whole batch, frames after the first one that
+    // didn't fit are not sent
+    if (queued == argc - 1) {
+        usnprintf(resp, MAX_RESP_SIZE, "ok: txb queued %u\r\n", queued);
+    } else {
+        usnprintf(resp, MAX_RESP_SIZE,
+                  "error: queue full, queued %u dropped %u\r\n",
+                  queued, argc - 1 - queued);
+    }
+    usb_send_str(resp);
+
+    return CMD_REPLIED;
+}
+
+uint32_t cmd_replay(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    int i;
+    int32_t bus;
+    uint32_t gap;
+    uint32_t speed;
+    uint32_t loops;
+    uint32_t queued = 0;
+    can_frame_t frame;
+    stream_status_t status;
+    char resp[MAX_RESP_SIZE];
+
+    if (argc < 1) {
+        // need at least an action
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 1: action
+    if (ustrcasecmp("add", argv[1]) == 0 && argc >= 3) {
+        // add: arg 2 is the bus, args 3 on are frames written like txb's,
+        // each gap being the time since the previous frame in the trace
+        bus = get_bus(argv[2]);
+        if (bus < 0) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        for (i = 3; i <= argc; i++) {
+            if (!get_frame(argv[i], &frame, &gap)) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+        }
+        for (i = 3; i <= argc; i++) {
+            get_frame(argv[i], &frame, &gap);
+            if (!stream_push(STREAM_REPLAY, bus, &frame, gap)) {
+                break;
+            }
+            queued++;
+        }
+        // keeps a running replay going, does nothing while paused
+        stream_start(STREAM_REPLAY);
+
+        // one reply like txb's, with the space left for the host to refill
+        // the buffer by
+        if (queued == argc - 2) {
+            usnprintf(resp, MAX_RESP_SIZE, "ok: replay queued %u space %u\r\n",
+                      queued, stream_space(STREAM_REPLAY));
+        } else {
+            usnprintf(resp, MAX_RESP_SIZE,
+                      "error: queue full, queued %u dropped %u space %u\r\n",
+                      queued, argc - 2 - queued, stream_space(STREAM_REPLAY));
+        }
+        usb_send_str(resp);
+        return CMD_REPLIED;
+    } else if (ustrcasecmp("pause", argv[1]) == 0) {
+        // pause: hold frames until start, used to preload a trace
+        stream_pause(STREAM_REPLAY);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("start", argv[1]) == 0) {
+        // start: arg 2 is the speed in percent of the original timing,
+        // arg 3 the number of passes over the buffer, 0 to loop until
+        // stopped. looping needs the whole trace in the buffer.
+        speed = (argc >= 2) ? ustrtoul(argv[2], NULL, 0) :
+                STREAM_SPEED_NORMAL;
+        loops = (argc >= 3) ? ustrtoul(argv[3], NULL, 0) : 1;
+        if (speed == 0) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        stream_resume(STREAM_REPLAY, speed, loops);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("stop", argv[1]) == 0) {
+        // stop: drop everything that hasn't been sent and say how many
+        usnprintf(resp, MAX_RESP_SIZE, "ok: replay dropped %u\r\n",
+                  stream_clear(STREAM_REPLAY));
+        usb_send_str(resp);
+        return CMD_REPLIED;
+    } else if (ustrcasecmp("status", argv[1]) == 0) {
+        stream_get_status(STREAM_REPLAY, &status);
+        usnprintf(resp, MAX_RESP_SIZE,
+                  "replay: %s buffered %u space %u sent %u loops %u "
+                  "speed %u\r\n",
+                  status.paused ? "paused" : "running", status.buffered,
+                  status.space, status.sent, status.loops, status.speed);
+        usb_send_str(resp);
+        return CMD_ERROR_NONE;
+    }
+
+    return CMD_ERROR_INVALID_ARG;
+}
+
+uint32_t cmd_isotp(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    int i;
+    int32_t bus;
+    int32_t high;
+    int32_t low;
+    uint32_t len;
+    uint32_t flags;
+    char *hex;
+    uint8_t data[CMD_MAX_ARG_SIZE / 2];
+    isotp_config_t config;
+
+    if (argc < 2) {
+        // need at least bus and action args
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 1: select bus
+    bus = get_bus(argv[1]);
+    if (bus < 0) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 2: action
+    if (ustrcasecmp("set", argv[2]) == 0 && argc >= 4) {
+        // set: args 3 and 4 are the ids to send and receive with. args 5
+        // and 6 optionally give the block size and STmin to ask senders
+        // for, arg 7 "nopad" sends frames only as long as needed.
+        if (!get_id(argv[3], &config.tx_id, &flags)) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        config.tx_flags = flags & CAN_FRAME_EXTENDED;
+        if (!get_id(argv[4], &config.rx_id, &flags)) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        config.rx_flags = flags & CAN_FRAME_EXTENDED;
+        config.block_size = (argc >= 5) ? ustrtoul(argv[5], NULL, 0) : 0;
+        config.st_min = (argc >= 6) ? ustrtoul(argv[6], NULL, 0) : 0;
+        config.padding = true;
+        if (argc >= 7) {
+            if (ustrcasecmp("nopad", argv[7]) == 0) {
+                config.padding = false;
+            } else if (ustrcasecmp("pad", argv[7]) != 0) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+        }
+        isotp_configure(bus, &config);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("off", argv[2]) == 0) {
+        isotp_disable(bus);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("data", argv[2]) == 0 && argc >= 3) {
+        // data: append the bytes in args 3 on, as pairs of hex digits, to
+        // the PDU to send
+        for (i = 3; i <= argc; i++) {
+            len = 0;
+            for (hex = argv[i]; *hex != '\0'; hex += 2) {
+                high = hex_digit(hex[0]);
+                low = hex_digit(hex[1]);
+                if (high < 0 || low < 0) {
+                    return CMD_ERROR_INVALID_ARG;
+                }
+                data[len] = (high << 4) | low;
+                len++;
+            }
+            if (!isotp_write(bus, data, len)) {
+                // too long, or a PDU is being sent
+                return CMD_ERROR_INVALID_ARG;
+            }
+        }
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("send", argv[2]) == 0) {
+        // send: the result is reported once the PDU is sent
+        if (!isotp_send(bus)) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("abort", argv[2]) == 0) {
+        isotp_abort(bus);
+        return CMD_ERROR_NONE;
+    }
+
+    return CMD_ERROR_INVALID_ARG;
+}
+
+uint32_t cmd_j1939(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    int32_t bus;
+    uint32_t addr;
+    char resp[MAX_RESP_SIZE];
+
+    if (argc < 2) {
+        // need at least bus and action args
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 1: select bus
+    bus = get_bus(argv[1]);
+    if (bus < 0) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 2: action
+    if (ustrcasecmp("on", argv[2]) == 0) {
+        // on: reassemble transport transfers instead of passing their frames
+        j1939_enable(bus, true);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("off", argv[2]) == 0) {
+        j1939_enable(bus, false);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("addr", argv[2]) == 0 && argc >= 3) {
+        // addr: answer connection mode transfers sent to the address in
+        // arg 3, or only listen if it is "off"
+        if (ustrcasecmp("off", argv[3]) == 0) {
+            j1939_set_address(bus, -1);
+            return CMD_ERROR_NONE;
+        }
+        addr = ustrtoul(argv[3], NULL, 0);
+        if (addr >= J1939_GLOBAL) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        j1939_set_address(bus, addr);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("stats", argv[2]) == 0) {
+        usnprintf(resp, MAX_RESP_SIZE, "j1939: dropped %u\r\n",
+                  j1939_dropped(bus));
+        usb_send_str(resp);
+        return CMD_ERROR_NONE;
+    }
+
+    return CMD_ERROR_INVALID_ARG;
+}
+
+uint32_t cmd_respond(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    int32_t bus;
+    uint32_t flags;
+    uint32_t gap;
+    responder_rule_t rule;
+    char resp[MAX_RESP_SIZE];
+
+    if (argc < 2) {
+        // need at least bus and action args
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 1: bus the requests are received on and answered on
+    bus = get_bus(argv[1]);
+    if (bus < 0) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 2: action
+    if (ustrcasecmp("add", argv[2]) == 0 && argc >= 7) {
+        // add: args 3 - 6 are the request id, id mask, data and data mask,
+        // "-" for data that isn't checked. arg 7 is the response written
+        // like txb frames, arg 8 optionally delays it in microseconds.
+        rule.bus = bus;
+        if (!get_id(argv[3], &rule.id, &flags)) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        rule.id_flags = flags & CAN_FRAME_EXTENDED;
+        rule.mask = ustrtoul(argv[4], NULL, 0);
+        // only compare the bits covered by the mask
+        rule.id &= rule.mask;
+        if (ustrcmp("-", argv[5]) == 0) {
+            get_bytes("", rule.data);
+            get_bytes("", rule.data_mask);
+        } else if (!get_bytes(argv[5], rule.data) ||
+                   !get_bytes(argv[6], rule.data_mask)) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        if (!get_frame(argv[7], &rule.response, &gap) || gap != 0) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        rule.delay = (argc >= 8) ? ustrtoul(argv[8], NULL, 0) : 0;
+
+        if (!responder_add_rule(&rule)) {
+            // rule table is full
+            return CMD_ERROR_INVALID_ARG;
+        }
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("clear", argv[2]) == 0) {
+        // clear: remove all rules for the bus
+        responder_clear_rules(bus);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("stats", argv[2]) == 0) {
+        usnprintf(resp, MAX_RESP_SIZE, "respond: answered %u\r\n",
+                  responder_answered(bus));
+        usb_send_str(resp);
+        return CMD_ERROR_NONE;
+    }
+
+    return CMD_ERROR_INVALID_ARG;
+}
+
+uint32_t cmd_query(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    int32_t bus;
+    uint32_t gap;
+    uint32_t id;
+    uint32_t flags;
+    uint32_t mask;
+    uint32_t timeout;
+    can_frame_t request;
+
+    if (argc < 4) {
+        // need at least bus, request, response id and mask
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 1: select bus
+    bus = get_bus(argv[1]);
+    if (bus < 0) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 2: request, written like txb frames
+    if (!get_frame(argv[2], &request, &gap) || gap != 0) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+    // args 3 and 4: response id and mask
+    if (!get_id(argv[3], &id, &flags)) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+    mask = ustrtoul(argv[4], NULL, 0);
+    // arg 5: time to wait for the response in microseconds
+    timeout = (argc >= 5) ? ustrtoul(argv[5], NULL, 0) : QUERY_DEFAULT_TIMEOUT;
+
+    if (!query_start(bus, &request, id, mask, flags & CAN_FRAME_EXTENDED,
+                     timeout)) {
+        // a query is already waiting, or the transmit queue is full
+        return CMD_ERROR_QUEUE_FULL;
+    }
+    return CMD_ERROR_NONE;
+}
+
+uint32_t cmd_mode(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    char resp[MAX_RESP_SIZE];
+
+    if (argc < 1) {
+        // no mode given: report the current one
+        usnprintf(resp, MAX_RESP_SIZE, "mode: %s record %d\r\n",
+                  record_binary() ? "bin" : "text", RECORD_SIZE);
+        usb_send_str(resp);
+        return CMD_ERROR_NONE;
+    }
+
+    // arg 1: how received frames are sent, as rx lines or binary records.
+    // see record.h for the record layout.
+    if (ustrcasecmp("text", argv[1]) == 0) {
+        record_set_binary(false);
+    } else if (ustrcasecmp("bin", argv[1]) == 0) {
+        record_set_binary(true);
+    } else {
+        return CMD_ERROR_INVALID_ARG;
+    }
+    return CMD_ERROR_NONE;
+}
+
+// data watchpoint and trace unit's cycle counter
+#define DWT_CTRL 0xE0001000
+#define DWT_CYCCNT 0xE0001004
+#define DWT_CTRL_CYCCNTENA 0x00000001
+#define DEMCR_TRCENA 0x01000000
+
+// number of frames each encoder is timed over
+#define BENCH_FRAMES 64
+
+// the rx line formatting encode_rx_line replaced, kept to compare against
+static void bench_usnprintf(char *buf, uint32_t bus, can_frame_t *frame) {
+    usnprintf(buf, ENCODE_RX_LINE_SIZE,
+                (frame->flags & CAN_FRAME_EXTENDED) ?
+                "rx %d %08X%d%02X%02X%02X%02X%02X%02X%02X%02X %08X%08X\r\n" :
+                "rx %d %03X%d%02X%02X%02X%02X%02X%02X%02X%02X %08X%08X\r\n",
+                bus, frame->id, frame->len, frame->data[0],
+                frame->data[1], frame->data[2], frame->data[3],
+                frame->data[4], frame->data[5], frame->data[6],
+                frame->data[7], (uint32_t) (frame->timestamp >> 32),
+                (uint32_t) frame->timestamp);
+}
+
+uint32_t cmd_bench(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    char old_line[ENCODE_RX_LINE_SIZE];
+    char new_line[ENCODE_RX_LINE_SIZE];
+    char resp[MAX_RESP_SIZE];
+    can_frame_t frame;
+    uint32_t old_cycles = 0;
+    uint32_t new_cycles = 0;
+    uint32_t start;
+    uint32_t i;
+    uint32_t j;
+    bool match = true;
+
+    // start the cycle counter
+    HWREG(NVIC_DBG_INT) |= DEMCR_TRCENA;
+    HWREG(DWT_CTRL) |= DWT_CTRL_CYCCNTENA;
+
+    // frames of both id types with varied data and timestamps
+    for (i = 0; i < BENCH_FRAMES; i++) {
+        frame.id = (i & 1) ? 0x18DAF100 + i : 0x700 + i;
+        frame.flags = (i & 1) ? CAN_FRAME_EXTENDED : 0;
+        frame.len = i % 9;
+        for (j = 0; j < 8; j++) {
+            frame.data[j] = i * 37 + j * 11;
+        }
+        frame.timestamp = ((uint64_t) i << 32) | (i * 0x01234567);
+
+        start = HWREG(DWT_CYCCNT);
+        bench_usnprintf(old_line, CAN_BUS_1, &frame);
+        old_cycles += HWREG(DWT_CYCCNT) - start;
+
+        start = HWREG(DWT_CYCCNT);
+        encode_rx_line(new_line, CAN_BUS_1, &frame);
+        new_cycles += HWREG(DWT_CYCCNT) - start;
+
+        if (ustrcmp(old_line, new_line) != 0) {
+            match = false;
+        }
+    }
+
+    // average cycles per frame
+    usnprintf(resp, MAX_RESP_SIZE,
+              "bench: usnprintf %u encode %u cycles %s\r\n",
+              old_cycles / BENCH_FRAMES, new_cycles / BENCH_FRAMES,
+              match ? "match" : "mismatch");
+    usb_send_str(resp);
+
+    return CMD_ERROR_NONE;
+}
+
+uint32_t cmd_usb(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    char resp[MAX_RESP_SIZE];
+    const char *end;
+    uint32_t timeout;
+
+    if (argc >= 2 && ustrcasecmp("flush", argv[1]) == 0) {
+        // flush: longest time to hold output back for a full packet in
+        // microseconds, 0 sends it straight away
+        timeout = ustrtoul(argv[2], &end, 10);
+        if (end == argv[2] || *end != '\0' ||
+            (timeout != 0 &&
+             (timeout < USB_FLUSH_MIN || timeout > USB_FLUSH_MAX))) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        usb_set_flush_timeout(timeout);
+        return CMD_ERROR_NONE;
+    } else if (argc >= 1) {
+        return CMD_ERROR_INVALID_ARG;
     }
 
-    tx_msg.pui8MsgData = tx_data;
-    tx_msg.ui32Flags = 0;
-    can_send(bus, &tx_msg);
+    // report the output counters
+    usnprintf(resp, MAX_RESP_SIZE,
+              "usb: dropped %u stalls %u space %u flush %u\r\n",
+              usb_tx_dropped(), usb_tx_stalls(), usb_tx_space(),
+              usb_flush_timeout());
+    usb_send_str(resp);
+
     return CMD_ERROR_NONE;
 }
+
+uint32_t cmd_gw(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    int32_t bus;
+    uint32_t flags;
+    gateway_rule_t rule;
+
+    if (argc < 2) {
+        // need at least bus and action args
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 1: bus to forward frames from
+    bus = get_bus(argv[1]);
+    if (bus < 0) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 2: action
+    if (ustrcasecmp("on", argv[2]) == 0) {
+        // on: forward frames to the other bus
+        gateway_enable(bus, true);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("off", argv[2]) == 0) {
+        // off: stop forwarding
+        gateway_enable(bus, false);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("clear", argv[2]) == 0) {
+        // clear: remove all rules for the bus
+        gateway_clear_rules(bus);
+        return CMD_ERROR_NONE;
+    }
+
+    // the remaining actions add a rule, args 3 and 4 are the id and mask
+    if (argc < 4) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+    rule.bus = bus;
+    if (!get_id(argv[3], &rule.id, &flags)) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+    rule.id_flags = flags & CAN_FRAME_EXTENDED;
+    rule.mask = ustrtoul(argv[4], NULL, 0);
+    // only compare the bits covered by the mask
+    rule.id &= rule.mask;
+
+    if (ustrcasecmp("drop", argv[2]) == 0) {
+        // drop: don't forward matching frames
+        rule.action = GATEWAY_DROP;
+    } else if (ustrcasecmp("pass", argv[2]) == 0) {
+        // pass: forward matching frames without checking later rules, put
+        // ahead of a drop rule to forward only some ids
+        rule.action = GATEWAY_PASS;
+    } else if (ustrcasecmp("remap", argv[2]) == 0 && argc >= 5) {
+        // remap: forward matching frames with the id in arg 5
+        rule.action = GATEWAY_REMAP;
+        if (!get_id(argv[5], &rule.new_id, &flags)) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        rule.new_id_flags = flags & CAN_FRAME_EXTENDED;
+    } else if (ustrcasecmp("byte", argv[2]) == 0 && argc >= 7) {
+        // byte: replace the bits in arg 7 of the byte at index arg 5 with
+        // the value in arg 6
+        rule.action = GATEWAY_BYTE;
+        rule.index = ustrtoul(argv[5], NULL, 0);
+        rule.value = ustrtoul(argv[6], NULL, 0);
+        rule.bits = ustrtoul(argv[7], NULL, 0);
+        if (rule.index > 7) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+    } else {
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    if (!gateway_add_rule(&rule)) {
+        // rule table is full
+        return CMD_ERROR_INVALID_ARG;
+    }
+    return CMD_ERROR_NONE;
+}
+
+uint32_t cmd_periodic(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
+    int32_t bus;
+    int32_t index;
+    uint32_t i;
+    uint32_t flags;
+    periodic_entry_t entry;
+    char resp[MAX_RESP_SIZE];
+
+    if (argc < 2) {
+        // need at least bus and action args
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 1: select bus
+    bus = get_bus(argv[1]);
+    if (bus < 0) {
+        return CMD_ERROR_INVALID_ARG;
+    }
+
+    // arg 2: action
+    if (ustrcasecmp("add", argv[2]) == 0 && argc >= 5) {
+        // add: args 3 - 5 are the id, the data as hex digits ("-" for
+        // none) and the period in microseconds. arg 6 optionally limits the
+        // number of frames sent, arg 7 delays the first one.
+        entry.bus = bus;
+        if (!get_id(argv[3], &entry.frame.id, &flags)) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        entry.frame.flags = flags;
+        if (ustrcmp("-", argv[4]) == 0) {
+            entry.frame.len = 0;
+            get_bytes("", entry.frame.data);
+        } else {
+            if (!get_bytes(argv[4], entry.frame.data)) {
+                return CMD_ERROR_INVALID_ARG;
+            }
+            entry.frame.len = ustrlen(argv[4]) / 2;
+        }
+        entry.period = ustrtoul(argv[5], NULL, 0);
+        entry.count = (argc >= 6) ? ustrtoul(argv[6], NULL, 0) : 0;
+        entry.phase = (argc >= 7) ? ustrtoul(argv[7], NULL, 0) : 0;
+
+        index = periodic_add(&entry);
+        if (index < 0) {
+            // table is full or the period is 0
+            return CMD_ERROR_INVALID_ARG;
+        }
+        usnprintf(resp, MAX_RESP_SIZE, "periodic: %d\r\n", index);
+        usb_send_str(resp);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("del", argv[2]) == 0 && argc >= 3) {
+        // del: stop the frame at the index in arg 3
+        if (!periodic_get(ustrtoul(argv[3], NULL, 0), &entry) ||
+            entry.bus != bus) {
+            return CMD_ERROR_INVALID_ARG;
+        }
+        periodic_remove(ustrtoul(argv[3], NULL, 0));
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("clear", argv[2]) == 0) {
+        // clear: stop all frames on the bus
+        periodic_clear(bus);
+        return CMD_ERROR_NONE;
+    } else if (ustrcasecmp("list", argv[2]) == 0) {
+        // list: one line per frame, count is the number left to send
+        for (i = 0; i < PERIODIC_MAX_ENTRIES; i++) {
+            if (!periodic_get(i, &entry) || entry.bus != bus) {
+                continue;
+            }
+            // ids and data are written like rx lines
+            usnprintf(resp, MAX_RESP_SIZE,
+                      (entry.frame.flags & CAN_FRAME_EXTENDED) ?
+                      "periodic %u %08X%d%02X%02X%02X%02X%02X%02X%02X%02X "
+                      "%u %u\r\n" :
+                      "periodic %u %03X%d%02X%02X%02X%02X%02X%02X%02X%02X "
+                      "%u %u\r\n",
+                      i, entry.frame.id, entry.frame.len, entry.frame.data[0],
+                      entry.frame.data[1], entry.frame.data[2],
+                      entry.frame.data[3], entry.frame.data[4],
+                      entry.frame.data[5], entry.frame.data[6],
+                      entry.frame.data[7], entry.period, entry.count);
+            usb_send_str(resp);
+        }
+        return CMD_ERROR_NONE;
+    }
+
+    return CMD_ERROR_INVALID_ARG;
+}
@@ -4,12 +4,26 @@
 enum {
     CMD_ERROR_NONE = 0,
     CMD_ERROR_UNKNOWN_CMD,
-    CMD_ERROR_INVALID_ARG
+    CMD_ERROR_INVALID_ARG,
+    CMD_ERROR_QUEUE_FULL,
+    // the command sent its own ok or error reply
+    CMD_REPLIED
 };
 
 
 uint32_t cmd_reset(int, char[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
 uint32_t cmd_bus(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
 uint32_t cmd_tx(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_txb(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_replay(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_isotp(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_j1939(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_respond(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_query(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_mode(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_bench(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_usb(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_gw(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
+uint32_t cmd_periodic(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
 
 #endif
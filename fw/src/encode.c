@@ -0,0 +1,74 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "can.h"
+#include "encode.h"
+
+// frame to text encoding for the receive path
+//
+// writes the same text as formatting with usnprintf, but without parsing a
+// format string or handling varargs for every frame.
+
+// lower case, as usnprintf writes %X
+static const char hex[] = "0123456789abcdef";
+
+// write the low digits hex digits of value
+static char *put_hex(char *buf, uint32_t value, uint32_t digits) {
+    char *end = buf + digits;
+
+    while (digits-- > 0) {
+        buf[digits] = hex[value & 0x0F];
+        value >>= 4;
+    }
+    return end;
+}
+
+// write len bytes as pairs of hex digits, like "%02X" for each byte.
+// returns the number of characters written, the text isn't null
+// terminated.
+uint32_t encode_bytes(char *buf, uint8_t *data, uint32_t len) {
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[2 * i] = hex[data[i] >> 4];
+        buf[2 * i + 1] = hex[data[i] & 0x0F];
+    }
+    return 2 * len;
+}
+
+// write a frame as its id, length, data and timestamp, like
+// "%03X%d%02X...%02X %08X%08X" with 8 id digits for extended ids. returns
+// the number of characters written, the text isn't null terminated.
+uint32_t encode_frame(char *buf, can_frame_t *frame) {
+    char *pos = buf;
+
+    // standard ids are 3 hex digits, extended ids are 8
+    pos = put_hex(pos, frame->id,
+                  (frame->flags & CAN_FRAME_EXTENDED) ? 8 : 3);
+    *(pos++) = '0' + frame->len;
+    pos += encode_bytes(pos, frame->data, 8);
+    *(pos++) = ' ';
+    pos = put_hex(pos, frame->timestamp >> 32, 8);
+    pos = put_hex(pos, (uint32_t) frame->timestamp, 8);
+
+    return pos - buf;
+}
+
+// write a whole rx line for a frame received on bus, null terminated.
+// buf must hold ENCODE_RX_LINE_SIZE characters. returns the length of the
+// line.
+uint32_t encode_rx_line(char *buf, uint32_t bus, can_frame_t *frame) {
+    char *pos = buf;
+
+    *(pos++) = 'r';
+    *(pos++) = 'x';
+    *(pos++) = ' ';
+    *(pos++) = '0' + bus;
+    *(pos++) = ' ';
+    pos += encode_frame(pos, frame);
+    *(pos++) = '\r';
+    *(pos++) = '\n';
+    *pos = '\0';
+
+    return pos - buf;
+}
@@ -0,0 +1,13 @@
+#ifndef _ENCODE_H_
+#define _ENCODE_H_
+
+#include "can.h"
+
+// longest rx line, including the terminating null
+#define ENCODE_RX_LINE_SIZE 50
+
+uint32_t encode_bytes(char*, uint8_t*, uint32_t);
+uint32_t encode_frame(char*, can_frame_t*);
+uint32_t encode_rx_line(char*, uint32_t, can_frame_t*);
+
+#endif
@@ -0,0 +1,474 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driverlib/rom.h"
+#include "driverlib/interrupt.h"
+
+#include "can.h"
+#include "filter.h"
+
+// software filters, applied in the CAN ISRs to every frame before it is
+// queued for the host. the gateway, responder and protocol engines see
+// frames before they are filtered.
+//
+// an id list is loaded into the hardware as a small set of id/mask filters
+// computed to let through as few other ids as possible. since the masks
+// can still let some other ids through, frames are checked against the
+// exact list before they are passed on. the list can also be applied in
+// software alone, leaving the hardware filters as they are.
+//
+// the check takes constant time: standard ids are looked up in a bitmap
+// with one bit per id, and extended ids in a hash set holding the index of
+// each id in the list.
+//
+// frames that pass the id list are then checked against payload rules,
+// which select frames of an id by length and data bytes, and against the
+// trigger. while a trigger is armed, every frame is dropped until one
+// matches it.
+
+#define STD_ID_MASK CAN_STD_ID_MASK
+#define EXT_ID_MASK CAN_EXT_ID_MASK
+
+// list entries are the id, with this bit set for extended ids, so that
+// sorting puts all standard ids before all extended ids
+#define KEY_EXTENDED 0x80000000
+
+// an id/mask pair while the filters are being computed
+typedef struct {
+    uint32_t key;
+    uint32_t mask;
+} group_t;
+
+// hash set slots, a power of 2 at least twice FILTER_MAX_IDS so that
+// probe sequences stay short
+#define HASH_SIZE 512
+#define HASH_BITS 9
+// an unused hash set slot, list indices are always lower
+#define HASH_EMPTY 0xFF
+
+// per bus id lists, sorted once loaded, indexed by bus number - CAN_BUS_1
+static uint32_t id_lists[2][FILTER_MAX_IDS];
+static uint32_t id_counts[2];
+// true once a list has been loaded and frames should be checked against it
+static volatile bool id_list_enabled[2];
+
+// per bus lookup tables built from the id lists
+static uint8_t std_bitmap[2][(STD_ID_MASK + 1) / 8];
+static uint8_t ext_hash[2][HASH_SIZE];
+
+// per bus payload rules
+static filter_payload_t payload_rules[2][FILTER_MAX_PAYLOAD];
+static uint32_t payload_counts[2];
+
+// per bus triggers
+static filter_payload_t triggers[2];
+static volatile bool trigger_armed[2];
+// frames rejected, indexed by bus - CAN_BUS_1
+static volatile uint32_t rejected[2];
+
+// scratch space for computing filters, shared by both buses
+static group_t groups[FILTER_MAX_IDS];
+
+static uint32_t make_key(uint32_t id, uint32_t flags) {
+    if (flags & CAN_FRAME_EXTENDED) {
+        return (id & EXT_ID_MASK) | KEY_EXTENDED;
+    }
+    return id & STD_ID_MASK;
+}
+
+// hash set slot to start probing from for an extended key
+static uint32_t hash(uint32_t key) {
+    // fibonacci hashing, the top bits of the product are the best mixed
+    return (key * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// number of ids a group lets through
+static uint32_t coverage(group_t *group) {
+    uint32_t width = (group->key & KEY_EXTENDED) ? EXT_ID_MASK : STD_ID_MASK;
+
+    return 1 << __builtin_popcount(~group->mask & width);
+}
+
+// the smallest group covering both a and b
+static group_t merge(group_t *a, group_t *b) {
+    group_t merged;
+
+    merged.mask = a->mask & b->mask & ~(a->key ^ b->key);
+    merged.key = a->key & merged.mask;
+
+    return merged;
+}
+
+// true if every id let through by b is also let through by a
+static bool covers(group_t *a, group_t *b) {
+    return (a->key & KEY_EXTENDED) == (b->key & KEY_EXTENDED) &&
+           (b->mask & a->mask) == a->mask &&
+           (b->key & a->mask) == a->key;
+}
+
+static void remove_group(uint32_t index, uint32_t *count) {
+    for ((*count)--; index < *count; index++) {
+        groups[index] = groups[index + 1];
+    }
+}
+
+// reduce a sorted id list to at most max_groups groups
+//
+// starting with one group per id, the pair of neighbouring groups whose
+// merge lets through the fewest extra ids is merged until few enough are
+// left. neighbours in the sorted list share the most high bits, so only
+// they are considered, which keeps this to O(n^2) for n ids.
+static uint32_t optimize(uint32_t *keys, uint32_t count, uint32_t max_groups) {
+    uint32_t i;
+    uint32_t best;
+    int64_t cost;
+    int64_t best_cost;
+    group_t merged;
+
+    for (i = 0; i < count; i++) {
+        groups[i].key = keys[i];
+        groups[i].mask = (keys[i] & KEY_EXTENDED) ? EXT_ID_MASK | KEY_EXTENDED :
+                                                    STD_ID_MASK | KEY_EXTENDED;
+    }
+
+    while (count > max_groups) {
+        best = count;
+        best_cost = INT64_MAX;
+        for (i = 0; i + 1 < count; i++) {
+            if ((groups[i].key ^ groups[i + 1].key) & KEY_EXTENDED) {
+                // standard and extended ids can't share a filter
+                continue;
+            }
+            merged = merge(&groups[i], &groups[i + 1]);
+            cost = (int64_t) coverage(&merged) - coverage(&groups[i]) -
+                   coverage(&groups[i + 1]);
+            if (cost < best_cost) {
+                best = i;
+                best_cost = cost;
+            }
+        }
+        if (best == count) {
+            // nothing left that can be merged
+            break;
+        }
+
+        groups[best] = merge(&groups[best], &groups[best + 1]);
+        remove_group(best + 1, &count);
+
+        // the merged group may now cover its other neighbours as well
+        while (best + 1 < count && covers(&groups[best], &groups[best + 1])) {
+            remove_group(best + 1, &count);
+        }
+        while (best > 0 && covers(&groups[best], &groups[best - 1])) {
+            remove_group(best - 1, &count);
+            best--;
+        }
+    }
+
+    return count;
+}
+
+// remove all ids from a bus's list and stop checking frames against it
+void filter_ids_clear(uint32_t bus) {
+    id_list_enabled[bus - CAN_BUS_1] = false;
+    id_counts[bus - CAN_BUS_1] = 0;
+}
+
+// add an id to a bus's list, false if the list is full. the list isn't
+// used until it is loaded.
+bool filter_ids_add(uint32_t bus, uint32_t id, uint32_t flags) {
+    uint32_t *count = &id_counts[bus - CAN_BUS_1];
+
+    id_list_enabled[bus - CAN_BUS_1] = false;
+    if (*count >= FILTER_MAX_IDS) {
+        return false;
+    }
+    id_lists[bus - CAN_BUS_1][*count] = make_key(id, flags);
+    (*count)++;
+
+    return true;
+}
+
+// sort a bus's id list and remove duplicates, returns the new length
+static uint32_t sort_ids(uint32_t bus) {
+    uint32_t *keys = id_lists[bus - CAN_BUS_1];
+    uint32_t count = id_counts[bus - CAN_BUS_1];
+    uint32_t key;
+    uint32_t i;
+    uint32_t j;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // insertion sort, then remove duplicates
+    for (i = 1; i < count; i++) {
+        key = keys[i];
+        for (j = i; j > 0 && keys[j - 1] > key; j--) {
+            keys[j] = keys[j - 1];
+        }
+        keys[j] = key;
+    }
+    for (i = 1, j = 1; i < count; i++) {
+        if (keys[i] != keys[j - 1]) {
+            keys[j] = keys[i];
+            j++;
+        }
+    }
+    id_counts[bus - CAN_BUS_1] = j;
+
+    return j;
+}
+
+// build the lookup tables from a bus's id list and start using them
+static void apply_ids(uint32_t bus) {
+    uint32_t *keys = id_lists[bus - CAN_BUS_1];
+    uint32_t count = id_counts[bus - CAN_BUS_1];
+    uint8_t *bitmap = std_bitmap[bus - CAN_BUS_1];
+    uint8_t *slots = ext_hash[bus - CAN_BUS_1];
+    uint32_t slot;
+    uint32_t i;
+
+    for (i = 0; i < sizeof(std_bitmap[0]); i++) {
+        bitmap[i] = 0;
+    }
+    for (i = 0; i < HASH_SIZE; i++) {
+        slots[i] = HASH_EMPTY;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (keys[i] & KEY_EXTENDED) {
+            // linear probing, the set is never more than half full
+            for (slot = hash(keys[i]); slots[slot] != HASH_EMPTY;
+                 slot = (slot + 1) & (HASH_SIZE - 1));
+            slots[slot] = i;
+        } else {
+            bitmap[keys[i] >> 3] |= 1 << (keys[i] & 7);
+        }
+    }
+
+    id_list_enabled[bus - CAN_BUS_1] = true;
+}
+
+// check frames against a bus's id list in software only, without changing
+// the hardware filters. returns the number of ids, or -1 if there are none.
+int32_t filter_ids_apply(uint32_t bus) {
+    uint32_t count;
+
+    id_list_enabled[bus - CAN_BUS_1] = false;
+    count = sort_ids(bus);
+    if (count == 0) {
+        return -1;
+    }
+    apply_ids(bus);
+
+    return count;
+}
+
+// program the hardware filters of a bus to let through its id list, using
+// at most max_filters filters, and start checking frames against the list.
+// returns the number of filters used and sets extra to the number of ids
+// not in the list that the filters let through, or -1 on error.
+int32_t filter_ids_load(uint32_t bus, uint32_t max_filters, uint32_t *extra) {
+    uint32_t count;
+    uint32_t filter_count;
+    uint32_t i;
+    uint64_t total;
+    can_filter_t filter;
+
+    if (max_filters == 0 || max_filters > CAN_MAX_FILTERS) {
+        return -1;
+    }
+    id_list_enabled[bus - CAN_BUS_1] = false;
+
+    count = sort_ids(bus);
+    if (count == 0) {
+        return -1;
+    }
+
+    filter_count = optimize(id_lists[bus - CAN_BUS_1], count, max_filters);
+    if (filter_count > max_filters) {
+        return -1;
+    }
+
+    can_filter_clear(bus);
+    total = 0;
+    for (i = 0; i < filter_count; i++) {
+        filter.id = groups[i].key & ~KEY_EXTENDED;
+        filter.mask = groups[i].mask & ~KEY_EXTENDED;
+        filter.flags = CAN_FILTER_MATCH_IDE;
+        if (groups[i].key & KEY_EXTENDED) {
+            filter.flags |= CAN_FILTER_EXTENDED;
+        }
+        can_filter_add(bus, &filter);
+        total += coverage(&groups[i]);
+    }
+    // saturate rather than wrap for very wide extended id masks
+    *extra = total - count > 0xFFFFFFFF ? 0xFFFFFFFF : total - count;
+
+    apply_ids(bus);
+
+    return filter_count;
+}
+
+// check a frame against the id list
+static bool id_accept(uint32_t bus, can_frame_t *frame) {
+    uint32_t key;
+    uint32_t slot;
+    uint8_t index;
+
+    if (!id_list_enabled[bus - CAN_BUS_1]) {
+        return true;
+    }
+
+    key = make_key(frame->id, frame->flags);
+    if (!(key & KEY_EXTENDED)) {
+        return std_bitmap[bus - CAN_BUS_1][key >> 3] & (1 << (key & 7));
+    }
+
+    for (slot = hash(key);
+         (index = ext_hash[bus - CAN_BUS_1][slot]) != HASH_EMPTY;
+         slot = (slot + 1) & (HASH_SIZE - 1)) {
+        if (id_lists[bus - CAN_BUS_1][index] == key) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// add a payload rule to a bus, false if the table is full
+bool filter_payload_add(uint32_t bus, filter_payload_t *rule) {
+    uint32_t *count = &payload_counts[bus - CAN_BUS_1];
+    bool ints_off;
+
+    if (*count >= FILTER_MAX_PAYLOAD) {
+        return false;
+    }
+
+    // the table is read from the CAN ISRs
+    ints_off = ROM_IntMasterDisable();
+    payload_rules[bus - CAN_BUS_1][*count] = *rule;
+    payload_rules[bus - CAN_BUS_1][*count].seen = false;
+    (*count)++;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return true;
+}
+
+// remove all payload rules from a bus
+void filter_payload_clear(uint32_t bus) {
+    payload_counts[bus - CAN_BUS_1] = 0;
+}
+
+// drop all frames on a bus until one matches the trigger
+void filter_trigger_arm(uint32_t bus, filter_payload_t *trigger) {
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    triggers[bus - CAN_BUS_1] = *trigger;
+    trigger_armed[bus - CAN_BUS_1] = true;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+void filter_trigger_disarm(uint32_t bus) {
+    trigger_armed[bus - CAN_BUS_1] = false;
+}
+
+// true while waiting for a trigger frame
+bool filter_trigger_armed(uint32_t bus) {
+    return trigger_armed[bus - CAN_BUS_1];
+}
+
+// check a frame's id and id type against a payload rule
+static bool id_match(filter_payload_t *rule, can_frame_t *frame) {
+    return !((frame->flags ^ rule->id_flags) & CAN_FRAME_EXTENDED) &&
+           !((frame->id ^ rule->id) & rule->mask);
+}
+
+// check a frame's length and data against a payload rule
+static bool payload_match(filter_payload_t *rule, can_frame_t *frame) {
+    int i;
+
+    if (frame->len < rule->min_len || frame->len > rule->max_len) {
+        return false;
+    }
+    for (i = 0; i < 8; i++) {
+        if ((frame->data[i] ^ rule->data[i]) & rule->data_mask[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// check a frame against the payload rules. frames are passed if no rule
+// applies to their id, or if any rule that does apply passes them.
+static bool payload_accept(uint32_t bus, can_frame_t *frame) {
+    filter_payload_t *rule = payload_rules[bus - CAN_BUS_1];
+    uint32_t count = payload_counts[bus - CAN_BUS_1];
+    bool applied = false;
+    bool changed;
+    uint32_t i;
+    int j;
+
+    for (i = 0; i < count; i++, rule++) {
+        if (!id_match(rule, frame)) {
+            continue;
+        }
+        applied = true;
+        if (!payload_match(rule, frame)) {
+            continue;
+        }
+        if (!(rule->flags & FILTER_PAYLOAD_CHANGE)) {
+            return true;
+        }
+
+        // pass only the first frame and those where the watched bits
+        // changed
+        changed = !rule->seen;
+        for (j = 0; j < 8; j++) {
+            if ((frame->data[j] ^ rule->last[j]) & rule->change_mask[j]) {
+                changed = true;
+            }
+            rule->last[j] = frame->data[j];
+        }
+        rule->seen = true;
+        if (changed) {
+            return true;
+        }
+    }
+
+    return !applied;
+}
+
+// check a received frame against the software filters, called from the
+// CAN ISRs before the frame is queued
+bool filter_accept(uint32_t bus, can_frame_t *frame) {
+    filter_payload_t *trigger = &triggers[bus - CAN_BUS_1];
+
+    if (!id_accept(bus, frame) || !payload_accept(bus, frame)) {
+        rejected[bus - CAN_BUS_1]++;
+        return false;
+    }
+
+    if (trigger_armed[bus - CAN_BUS_1]) {
+        if (!id_match(trigger, frame) || !payload_match(trigger, frame)) {
+            rejected[bus - CAN_BUS_1]++;
+            return false;
+        }
+        // triggered, pass this and all following frames
+        trigger_armed[bus - CAN_BUS_1] = false;
+    }
+
+    return true;
+}
+
+// number of frames kept from the host by the software filters
+uint32_t filter_rejected(uint32_t bus) {
+    return rejected[bus - CAN_BUS_1];
+}
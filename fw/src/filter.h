@@ -0,0 +1,51 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include "can.h"
+
+// maximum number of ids in a bus's id list
+#define FILTER_MAX_IDS 200
+
+// maximum number of payload rules per bus
+#define FILTER_MAX_PAYLOAD 8
+
+// payload rule flags
+//
+// of the frames matching the rule, pass only those whose data differs from
+// the last one seen in the bits set in change_mask
+#define FILTER_PAYLOAD_CHANGE 0x01
+
+// a payload rule, applied to frames of the id type in id_flags whose id
+// matches id in the bits set in mask. those frames are passed if their
+// length is between min_len and max_len and their data matches data in the
+// bits set in data_mask.
+typedef struct {
+    uint32_t id;
+    uint32_t mask;
+    uint8_t id_flags;
+    uint8_t flags;
+    uint8_t min_len;
+    uint8_t max_len;
+    uint8_t data[8];
+    uint8_t data_mask[8];
+    // FILTER_PAYLOAD_CHANGE: bits watched for changes, which should be
+    // outside data_mask as bits in it always match data
+    uint8_t change_mask[8];
+    // FILTER_PAYLOAD_CHANGE: data of the last frame seen
+    uint8_t last[8];
+    bool seen;
+} filter_payload_t;
+
+void filter_ids_clear(uint32_t);
+bool filter_ids_add(uint32_t, uint32_t, uint32_t);
+int32_t filter_ids_apply(uint32_t);
+int32_t filter_ids_load(uint32_t, uint32_t, uint32_t*);
+bool filter_payload_add(uint32_t, filter_payload_t*);
+void filter_payload_clear(uint32_t);
+void filter_trigger_arm(uint32_t, filter_payload_t*);
+void filter_trigger_disarm(uint32_t);
+bool filter_trigger_armed(uint32_t);
+bool filter_accept(uint32_t, can_frame_t*);
+uint32_t filter_rejected(uint32_t);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driverlib/rom.h"
+#include "driverlib/interrupt.h"
+
+#include "can.h"
+#include "gateway.h"
+
+// forwarding enabled, indexed by source bus - CAN_BUS_1
+static bool gateway_enabled[2];
+
+// rule table, rules[0] to rules[rule_count - 1] are in use
+static gateway_rule_t rules[GATEWAY_MAX_RULES];
+static uint32_t rule_count = 0;
+
+// enable or disable forwarding of frames received on a bus to the other bus
+void gateway_enable(uint32_t bus, bool enable) {
+    gateway_enabled[bus - CAN_BUS_1] = enable;
+}
+
+// append a rule to the table, false if the table is full
+bool gateway_add_rule(gateway_rule_t *rule) {
+    bool ints_off;
+
+    if (rule_count >= GATEWAY_MAX_RULES) {
+        return false;
+    }
+
+    // the table is read from the CAN ISRs
+    ints_off = ROM_IntMasterDisable();
+    rules[rule_count] = *rule;
+    rule_count++;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return true;
+}
+
+// remove all rules for frames from a bus
+void gateway_clear_rules(uint32_t bus) {
+    uint32_t i;
+    uint32_t kept = 0;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    for (i = 0; i < rule_count; i++) {
+        if (rules[i].bus != bus) {
+            rules[kept] = rules[i];
+            kept++;
+        }
+    }
+    rule_count = kept;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// forward a frame received on bus to the other bus, called from the CAN ISR
+//
+// matching rules are applied in table order until a drop or pass rule. a
+// drop rule stops the frame from being forwarded, a pass rule forwards it
+// with the changes made so far, so a pass rule for the ids to keep followed
+// by a drop rule for everything else forwards only those ids. frames that
+// reach the end of the table are forwarded with every matching rewrite.
+// the frame passed in is not modified, so the host still sees what was
+// received.
+void gateway_process(uint32_t bus, can_frame_t *frame) {
+    can_frame_t out;
+    gateway_rule_t *rule;
+    uint32_t i;
+
+    if (!gateway_enabled[bus - CAN_BUS_1]) {
+        return;
+    }
+
+    out = *frame;
+    for (i = 0; i < rule_count; i++) {
+        rule = &rules[i];
+        if (rule->bus != bus ||
+            (frame->flags ^ rule->id_flags) & CAN_FRAME_EXTENDED ||
+            (frame->id & rule->mask) != rule->id) {
+            continue;
+        }
+
+        switch (rule->action) {
+            case GATEWAY_DROP:
+                return;
+            case GATEWAY_PASS:
+                can_send_frame(bus == CAN_BUS_1 ? CAN_BUS_2 : CAN_BUS_1, &out);
+                return;
+            case GATEWAY_REMAP:
+                out.id = rule->new_id;
+                out.flags = (out.flags & ~CAN_FRAME_EXTENDED) |
+                            rule->new_id_flags;
+                break;
+            case GATEWAY_BYTE:
+                out.data[rule->index] = (out.data[rule->index] & ~rule->bits) |
+                                        (rule->value & rule->bits);
+                break;
+        }
+    }
+
+    can_send_frame(bus == CAN_BUS_1 ? CAN_BUS_2 : CAN_BUS_1, &out);
+}
@@ -0,0 +1,45 @@
+#ifndef _GATEWAY_H_
+#define _GATEWAY_H_
+
+#include "can.h"
+
+// maximum number of rewrite rules, shared by both directions
+#define GATEWAY_MAX_RULES 16
+
+// rule actions
+enum {
+    // stop forwarding the frame
+    GATEWAY_DROP = 0,
+    // forward the frame without checking any more rules
+    GATEWAY_PASS,
+    // replace the frame's id
+    GATEWAY_REMAP,
+    // replace the bits of one data byte
+    GATEWAY_BYTE
+};
+
+// a rewrite rule, applied to frames from bus of the id type in id_flags
+// whose id matches id under mask
+typedef struct {
+    uint8_t bus;
+    uint8_t action;
+    uint8_t id_flags;
+    // GATEWAY_REMAP: id type to forward the frame with
+    uint8_t new_id_flags;
+    // GATEWAY_BYTE: byte index to rewrite
+    uint8_t index;
+    // GATEWAY_BYTE: bits of the byte to replace, and their new value
+    uint8_t bits;
+    uint8_t value;
+    uint32_t id;
+    uint32_t mask;
+    // GATEWAY_REMAP: id to forward the frame with
+    uint32_t new_id;
+} gateway_rule_t;
+
+void gateway_enable(uint32_t, bool);
+bool gateway_add_rule(gateway_rule_t*);
+void gateway_clear_rules(uint32_t);
+void gateway_process(uint32_t, can_frame_t*);
+
+#endif
@@ -0,0 +1,234 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "can.h"
+#include "timestamp.h"
+#include "gs_usb_proto.h"
+
+#define GS_USB_CHANNELS 2
+
+// reported to the host in GS_USB_BREQ_DEVICE_CONFIG
+#define GS_USB_SW_VERSION 1
+#define GS_USB_HW_VERSION 1
+
+// optional features, the only one supported is timestamps on frames
+#define GS_USB_FEATURE_HW_TIMESTAMP 0x10
+
+// bit timing limits of the CAN controllers, in time quanta. tseg1 covers
+// the propagation and phase 1 segments, which share a field with the sync
+// segment in the controller. driverlib takes prescalers up to 1023.
+#define GS_USB_TSEG1_MIN 1
+#define GS_USB_TSEG1_MAX 15
+#define GS_USB_TSEG2_MIN 1
+#define GS_USB_TSEG2_MAX 8
+#define GS_USB_SJW_MAX 4
+#define GS_USB_BRP_MIN 1
+#define GS_USB_BRP_MAX 1023
+
+// set while a channel is started, indexed by channel
+static volatile bool started[GS_USB_CHANNELS];
+// send timestamps on the channel's frames
+static volatile bool timestamps[GS_USB_CHANNELS];
+
+static void put_u32(uint8_t *buf, uint32_t value) {
+    uint32_t i;
+
+    for (i = 0; i < 4; i++) {
+        buf[i] = value >> (i * 8);
+    }
+}
+
+static uint32_t get_u32(uint8_t *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+// build the reply to a device to host request in buf, which has room for
+// GS_USB_CONTROL_SIZE bytes. returns its size, 0 if the request isn't
+// supported.
+uint32_t gs_usb_control_in(uint32_t request, uint32_t channel, uint8_t *buf) {
+    uint32_t i;
+
+    switch (request) {
+        case GS_USB_BREQ_DEVICE_CONFIG:
+            // three reserved bytes, then the highest channel number
+            for (i = 0; i < 3; i++) {
+                buf[i] = 0;
+            }
+            buf[3] = GS_USB_CHANNELS - 1;
+            put_u32(buf + 4, GS_USB_SW_VERSION);
+            put_u32(buf + 8, GS_USB_HW_VERSION);
+            return 12;
+        case GS_USB_BREQ_BT_CONST:
+            if (channel >= GS_USB_CHANNELS) {
+                return 0;
+            }
+            put_u32(buf, GS_USB_FEATURE_HW_TIMESTAMP);
+            put_u32(buf + 4, can_clock());
+            put_u32(buf + 8, GS_USB_TSEG1_MIN);
+            put_u32(buf + 12, GS_USB_TSEG1_MAX);
+            put_u32(buf + 16, GS_USB_TSEG2_MIN);
+            put_u32(buf + 20, GS_USB_TSEG2_MAX);
+            put_u32(buf + 24, GS_USB_SJW_MAX);
+            put_u32(buf + 28, GS_USB_BRP_MIN);
+            put_u32(buf + 32, GS_USB_BRP_MAX);
+            // prescaler step
+            put_u32(buf + 36, 1);
+            return 40;
+        case GS_USB_BREQ_TIMESTAMP:
+            // the host only keeps the low 32 bits, and handles wrapping
+            put_u32(buf, (uint32_t)timestamp_get());
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+// size of the data a host to device request carries, 0 if the request
+// isn't supported. the request is stalled unless the host sends exactly
+// this much.
+uint32_t gs_usb_control_out_size(uint32_t request, uint32_t channel) {
+    switch (request) {
+        case GS_USB_BREQ_HOST_FORMAT:
+            return 4;
+        case GS_USB_BREQ_BITTIMING:
+            return (channel < GS_USB_CHANNELS) ? 20 : 0;
+        case GS_USB_BREQ_MODE:
+            return (channel < GS_USB_CHANNELS) ? 8 : 0;
+        default:
+            return 0;
+    }
+}
+
+// act on the data of a host to device request accepted by
+// gs_usb_control_out_size. by now the transfer has completed, so invalid
+// settings are ignored.
+void gs_usb_control_out(uint32_t request, uint32_t channel, uint8_t *data) {
+    uint32_t bus = channel + CAN_BUS_1;
+    uint32_t tseg1;
+    uint32_t tseg2;
+    uint32_t sjw;
+    uint32_t brp;
+
+    switch (request) {
+        case GS_USB_BREQ_HOST_FORMAT:
+            // the host says which byte order it uses, only little endian
+            // hosts are in use
+            break;
+        case GS_USB_BREQ_BITTIMING:
+            // propagation segment, phase segment 1, phase segment 2, sjw,
+            // prescaler
+            tseg1 = get_u32(data) + get_u32(data + 4);
+            tseg2 = get_u32(data + 8);
+            sjw = get_u32(data + 12);
+            brp = get_u32(data + 16);
+            if (tseg1 < GS_USB_TSEG1_MIN || tseg1 > GS_USB_TSEG1_MAX ||
+                tseg2 < GS_USB_TSEG2_MIN || tseg2 > GS_USB_TSEG2_MAX ||
+                sjw < 1 || sjw > GS_USB_SJW_MAX ||
+                brp < GS_USB_BRP_MIN || brp > GS_USB_BRP_MAX) {
+                break;
+            }
+            can_set_bit_timing(bus, brp, tseg1, tseg2, sjw);
+            break;
+        case GS_USB_BREQ_MODE:
+            // mode, then flags
+            if (get_u32(data) == GS_USB_MODE_START) {
+                timestamps[channel] =
+                    (get_u32(data + 4) & GS_USB_MODE_HW_TIMESTAMP) != 0;
+                can_enable(bus);
+                started[channel] = true;
+            } else {
+                started[channel] = false;
+                can_disable(bus);
+            }
+            break;
+    }
+}
+
+// stop all channels, when the host goes away
+void gs_usb_reset(void) {
+    uint32_t channel;
+
+    for (channel = 0; channel < GS_USB_CHANNELS; channel++) {
+        if (started[channel]) {
+            started[channel] = false;
+            can_disable(channel + CAN_BUS_1);
+        }
+    }
+}
+
+// true if the host has started the channel for a bus
+bool gs_usb_started(uint32_t bus) {
+    return started[bus - CAN_BUS_1];
+}
+
+// pack a frame on bus into a host frame at buf, which has room for
+// GS_USB_FRAME_TS_SIZE bytes. returns its size.
+uint32_t gs_usb_pack_frame(uint8_t *buf, uint32_t bus, can_frame_t *frame,
+                           uint32_t echo_id) {
+    uint32_t channel = bus - CAN_BUS_1;
+    uint32_t id = frame->id;
+    uint32_t i;
+
+    if (frame->flags & CAN_FRAME_EXTENDED) {
+        id |= GS_USB_ID_EXTENDED;
+    }
+    if (frame->flags & CAN_FRAME_REMOTE) {
+        id |= GS_USB_ID_REMOTE;
+    }
+
+    put_u32(buf, echo_id);
+    put_u32(buf + 4, id);
+    buf[8] = frame->len;
+    buf[9] = channel;
+    buf[10] = 0;
+    buf[11] = 0;
+    for (i = 0; i < 8; i++) {
+        buf[12 + i] = frame->data[i];
+    }
+
+    if (!timestamps[channel]) {
+        return GS_USB_FRAME_SIZE;
+    }
+    put_u32(buf + 20, (uint32_t)frame->timestamp);
+    return GS_USB_FRAME_TS_SIZE;
+}
+
+// unpack a host frame of size bytes at buf into the frame to send, its bus
+// and echo id. false if it isn't a valid frame.
+bool gs_usb_unpack_frame(uint8_t *buf, uint32_t size, uint32_t *bus,
+                         can_frame_t *frame, uint32_t *echo_id) {
+    uint32_t id;
+    uint32_t i;
+
+    if (size < GS_USB_FRAME_SIZE || buf[8] > 8 ||
+        buf[9] >= GS_USB_CHANNELS) {
+        return false;
+    }
+
+    id = get_u32(buf + 4);
+    if (id & GS_USB_ID_ERROR) {
+        // error frames only go to the host
+        return false;
+    }
+
+    *echo_id = get_u32(buf);
+    *bus = buf[9] + CAN_BUS_1;
+
+    frame->flags = 0;
+    if (id & GS_USB_ID_EXTENDED) {
+        frame->flags |= CAN_FRAME_EXTENDED;
+        frame->id = id & CAN_EXT_ID_MASK;
+    } else {
+        frame->id = id & CAN_STD_ID_MASK;
+    }
+    if (id & GS_USB_ID_REMOTE) {
+        frame->flags |= CAN_FRAME_REMOTE;
+    }
+    frame->len = buf[8];
+    for (i = 0; i < 8; i++) {
+        frame->data[i] = buf[12 + i];
+    }
+    frame->timestamp = 0;
+
+    return true;
+}
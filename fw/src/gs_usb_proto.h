@@ -0,0 +1,63 @@
+#ifndef _GS_USB_PROTO_H_
+#define _GS_USB_PROTO_H_
+
+#include "can.h"
+
+// gs_usb protocol, as spoken by the candleLight firmware and the Linux
+// gs_usb driver
+//
+// the host sets up the device with vendor control requests, the channel in
+// wValue. frames travel over the bulk endpoints as host frames, all
+// multi-byte fields little endian:
+//
+//   0-3    echo id, GS_USB_ECHO_RX for received frames. frames from the
+//          host are sent back with their echo id once queued.
+//   4-7    id, with the GS_USB_ID_* flags
+//   8      data length
+//   9      channel
+//   10     flags, unused
+//   11     reserved
+//   12-19  data
+//   20-23  timestamp in microseconds, only sent if the channel was started
+//          with GS_USB_MODE_HW_TIMESTAMP
+//
+// channel 0 is CAN_BUS_1, channel 1 is CAN_BUS_2.
+#define GS_USB_FRAME_SIZE 20
+#define GS_USB_FRAME_TS_SIZE 24
+#define GS_USB_ECHO_RX 0xFFFFFFFF
+
+// id flags, as used by SocketCAN
+#define GS_USB_ID_EXTENDED 0x80000000
+#define GS_USB_ID_REMOTE 0x40000000
+#define GS_USB_ID_ERROR 0x20000000
+
+// control requests
+enum {
+    GS_USB_BREQ_HOST_FORMAT = 0,
+    GS_USB_BREQ_BITTIMING,
+    GS_USB_BREQ_MODE,
+    GS_USB_BREQ_BERR,
+    GS_USB_BREQ_BT_CONST,
+    GS_USB_BREQ_DEVICE_CONFIG,
+    GS_USB_BREQ_TIMESTAMP,
+    GS_USB_BREQ_IDENTIFY
+};
+
+// GS_USB_BREQ_MODE modes and flags
+#define GS_USB_MODE_RESET 0
+#define GS_USB_MODE_START 1
+#define GS_USB_MODE_HW_TIMESTAMP 0x10
+
+// largest control request payload, GS_USB_BREQ_BT_CONST
+#define GS_USB_CONTROL_SIZE 40
+
+uint32_t gs_usb_control_in(uint32_t, uint32_t, uint8_t*);
+uint32_t gs_usb_control_out_size(uint32_t, uint32_t);
+void gs_usb_control_out(uint32_t, uint32_t, uint8_t*);
+void gs_usb_reset(void);
+bool gs_usb_started(uint32_t);
+uint32_t gs_usb_pack_frame(uint8_t*, uint32_t, can_frame_t*, uint32_t);
+bool gs_usb_unpack_frame(uint8_t*, uint32_t, uint32_t*, can_frame_t*,
+                         uint32_t*);
+
+#endif
@@ -0,0 +1,508 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "inc/hw_ints.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
+
+#include "driverlib/interrupt.h"
+#include "driverlib/rom.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+
+#include "can.h"
+#include "isotp.h"
+#include "timestamp.h"
+
+// ISO 15765-2 transport, one connection per bus
+//
+// received frames are handled in the CAN ISR, which answers first frames
+// with flow control and reassembles the PDU for the main loop to send to
+// the host. when sending, consecutive frames are paced by the receiver's
+// STmin using a one shot timer per bus: timer 2 for bus 1, timer 3 for
+// bus 2. timeouts are checked when the main loop polls for results.
+
+// protocol control information, the high nibble of the first byte
+#define PCI_SINGLE 0x00
+#define PCI_FIRST 0x10
+#define PCI_CONSECUTIVE 0x20
+#define PCI_FLOW_CONTROL 0x30
+
+// flow control status
+#define FC_CONTINUE 0
+#define FC_WAIT 1
+#define FC_OVERFLOW 2
+
+// how long to wait for a flow control frame (N_Bs) or the next
+// consecutive frame (N_Cr), in microseconds
+#define ISOTP_TIMEOUT 1000000
+
+// time to wait before trying again when the transmit queue is full, in
+// microseconds
+#define ISOTP_RETRY 50
+
+enum {
+    TX_IDLE = 0,
+    TX_WAIT_FC,
+    TX_SENDING
+};
+
+enum {
+    RX_IDLE = 0,
+    RX_RECEIVING,
+    // a whole PDU is waiting to be read
+    RX_DONE
+};
+
+typedef struct {
+    bool enabled;
+    isotp_config_t config;
+    uint32_t timer_base;
+
+    uint8_t tx_state;
+    uint8_t tx_result;
+    uint8_t tx_sn;
+    // receiver's block size and frames left in the current block
+    uint8_t tx_block_size;
+    uint8_t tx_block_left;
+    // receiver's STmin in microseconds
+    uint32_t tx_st_min;
+    uint32_t tx_len;
+    uint32_t tx_offset;
+    uint64_t tx_deadline;
+    uint8_t tx_data[ISOTP_MAX_LEN];
+
+    uint8_t rx_state;
+    uint8_t rx_result;
+    uint8_t rx_sn;
+    uint8_t rx_block_left;
+    uint32_t rx_len;
+    uint32_t rx_offset;
+    uint64_t rx_deadline;
+    uint8_t rx_data[ISOTP_MAX_LEN];
+} isotp_channel_t;
+
+// indexed by bus number - CAN_BUS_1
+static isotp_channel_t channels[2];
+
+// timer ticks per microsecond
+static uint32_t ticks_per_us;
+
+// convert an STmin byte to microseconds, reserved values mean the longest
+// time
+static uint32_t st_min_us(uint8_t st_min) {
+    if (st_min <= 0x7F) {
+        return st_min * 1000;
+    } else if (st_min >= 0xF1 && st_min <= 0xF9) {
+        return (st_min - 0xF0) * 100;
+    }
+    return 0x7F * 1000;
+}
+
+// send a frame with the connection's transmit id, false if the transmit
+// queue is full
+static bool send_frame(uint32_t bus, uint8_t *data, uint32_t len) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    can_frame_t frame;
+    uint32_t i;
+
+    frame.id = ch->config.tx_id;
+    frame.flags = ch->config.tx_flags;
+    frame.len = ch->config.padding ? 8 : len;
+    for (i = 0; i < 8; i++) {
+        frame.data[i] = (i < len) ? data[i] : ISOTP_PAD_BYTE;
+    }
+
+    return can_send_frame(bus, &frame);
+}
+
+static void send_flow_control(uint32_t bus, uint8_t status) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint8_t data[3];
+
+    data[0] = PCI_FLOW_CONTROL | status;
+    data[1] = ch->config.block_size;
+    data[2] = ch->config.st_min;
+    send_frame(bus, data, 3);
+}
+
+static void wait(isotp_channel_t *ch, uint32_t us) {
+    TimerLoadSet(ch->timer_base, TIMER_A, us * ticks_per_us);
+    TimerEnable(ch->timer_base, TIMER_A);
+}
+
+// send consecutive frames until the PDU is sent, the block ends or STmin
+// has to pass. interrupts must be off.
+static void tx_next(uint32_t bus) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint8_t data[8];
+    uint32_t len;
+    uint32_t i;
+
+    while (ch->tx_state == TX_SENDING) {
+        if (can_tx_space(bus) == 0) {
+            wait(ch, ISOTP_RETRY);
+            return;
+        }
+
+        len = ch->tx_len - ch->tx_offset;
+        if (len > 7) {
+            len = 7;
+        }
+        data[0] = PCI_CONSECUTIVE | ch->tx_sn;
+        for (i = 0; i < len; i++) {
+            data[i + 1] = ch->tx_data[ch->tx_offset + i];
+        }
+        send_frame(bus, data, len + 1);
+        ch->tx_offset += len;
+        ch->tx_sn = (ch->tx_sn + 1) & 0x0F;
+
+        if (ch->tx_offset >= ch->tx_len) {
+            ch->tx_state = TX_IDLE;
+            ch->tx_result = ISOTP_RESULT_DONE;
+            ch->tx_len = 0;
+            return;
+        }
+        if (ch->tx_block_size > 0 && --ch->tx_block_left == 0) {
+            // wait for the receiver to ask for the next block
+            ch->tx_state = TX_WAIT_FC;
+            ch->tx_deadline = timestamp_get() + ISOTP_TIMEOUT;
+            return;
+        }
+        if (ch->tx_st_min > 0) {
+            wait(ch, ch->tx_st_min);
+            return;
+        }
+    }
+}
+
+static void timer2_isr(void) {
+    TimerIntClear(TIMER2_BASE, TIMER_TIMA_TIMEOUT);
+    tx_next(CAN_BUS_1);
+}
+
+static void timer3_isr(void) {
+    TimerIntClear(TIMER3_BASE, TIMER_TIMA_TIMEOUT);
+    tx_next(CAN_BUS_2);
+}
+
+void isotp_init(void) {
+    // wait here if the peripherials aren't enabled
+    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_TIMER2));
+    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_TIMER3));
+
+    ticks_per_us = SysCtlClockGet() / 1000000;
+
+    channels[0].timer_base = TIMER2_BASE;
+    channels[1].timer_base = TIMER3_BASE;
+
+    TimerConfigure(TIMER2_BASE, TIMER_CFG_ONE_SHOT);
+    TimerIntRegister(TIMER2_BASE, TIMER_A, timer2_isr);
+    TimerIntEnable(TIMER2_BASE, TIMER_TIMA_TIMEOUT);
+
+    TimerConfigure(TIMER3_BASE, TIMER_CFG_ONE_SHOT);
+    TimerIntRegister(TIMER3_BASE, TIMER_A, timer3_isr);
+    TimerIntEnable(TIMER3_BASE, TIMER_TIMA_TIMEOUT);
+}
+
+// set up a bus's connection and start handling its frames. any transfer in
+// progress is dropped.
+void isotp_configure(uint32_t bus, isotp_config_t *config) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    TimerDisable(ch->timer_base, TIMER_A);
+    ch->config = *config;
+    ch->tx_state = TX_IDLE;
+    ch->tx_result = ISOTP_RESULT_NONE;
+    ch->tx_len = 0;
+    ch->rx_state = RX_IDLE;
+    ch->rx_result = ISOTP_RESULT_NONE;
+    ch->enabled = true;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// stop handling a bus's frames
+void isotp_disable(uint32_t bus) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    TimerDisable(ch->timer_base, TIMER_A);
+    ch->enabled = false;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// append data to the PDU to send, false if a PDU is being sent or it would
+// be too long
+bool isotp_write(uint32_t bus, uint8_t *data, uint32_t len) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint32_t i;
+
+    if (ch->tx_state != TX_IDLE || ch->tx_len + len > ISOTP_MAX_LEN) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        ch->tx_data[ch->tx_len + i] = data[i];
+    }
+    ch->tx_len += len;
+
+    return true;
+}
+
+// start sending the written PDU, false if there is nothing to send, a PDU
+// is already being sent or the transmit queue is full
+bool isotp_send(uint32_t bus) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint8_t data[8];
+    uint32_t i;
+    bool sent = false;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    if (ch->enabled && ch->tx_state == TX_IDLE && ch->tx_len > 0) {
+        ch->tx_result = ISOTP_RESULT_NONE;
+        if (ch->tx_len <= 7) {
+            // single frame
+            data[0] = PCI_SINGLE | ch->tx_len;
+            for (i = 0; i < ch->tx_len; i++) {
+                data[i + 1] = ch->tx_data[i];
+            }
+            sent = send_frame(bus, data, ch->tx_len + 1);
+            if (sent) {
+                ch->tx_result = ISOTP_RESULT_DONE;
+                ch->tx_len = 0;
+            }
+        } else {
+            // first frame, then wait for flow control
+            data[0] = PCI_FIRST | ((ch->tx_len >> 8) & 0x0F);
+            data[1] = ch->tx_len & 0xFF;
+            for (i = 0; i < 6; i++) {
+                data[i + 2] = ch->tx_data[i];
+            }
+            sent = send_frame(bus, data, 8);
+            if (sent) {
+                ch->tx_offset = 6;
+                ch->tx_sn = 1;
+                ch->tx_state = TX_WAIT_FC;
+                ch->tx_deadline = timestamp_get() + ISOTP_TIMEOUT;
+            }
+        }
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return sent;
+}
+
+// stop sending and drop the written PDU
+void isotp_abort(uint32_t bus) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    TimerDisable(ch->timer_base, TIMER_A);
+    ch->tx_state = TX_IDLE;
+    ch->tx_len = 0;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+static void rx_flow_control(uint32_t bus, can_frame_t *frame) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+
+    if (ch->tx_state != TX_WAIT_FC || frame->len < 3) {
+        return;
+    }
+
+    switch (frame->data[0] & 0x0F) {
+        case FC_CONTINUE:
+            ch->tx_block_size = frame->data[1];
+            ch->tx_block_left = frame->data[1];
+            ch->tx_st_min = st_min_us(frame->data[2]);
+            ch->tx_state = TX_SENDING;
+            tx_next(bus);
+            break;
+        case FC_WAIT:
+            ch->tx_deadline = timestamp_get() + ISOTP_TIMEOUT;
+            break;
+        default:
+            ch->tx_state = TX_IDLE;
+            ch->tx_result = ISOTP_RESULT_OVERFLOW;
+            ch->tx_len = 0;
+            break;
+    }
+}
+
+static void rx_first(uint32_t bus, can_frame_t *frame) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint32_t len;
+    uint32_t i;
+
+    len = ((frame->data[0] & 0x0F) << 8) | frame->data[1];
+    if (frame->len < 8 || len < 8) {
+        return;
+    }
+    if (len > ISOTP_MAX_LEN) {
+        send_flow_control(bus, FC_OVERFLOW);
+        ch->rx_state = RX_IDLE;
+        ch->rx_result = ISOTP_RESULT_OVERFLOW;
+        return;
+    }
+
+    for (i = 0; i < 6; i++) {
+        ch->rx_data[i] = frame->data[i + 2];
+    }
+    ch->rx_len = len;
+    ch->rx_offset = 6;
+    ch->rx_sn = 1;
+    ch->rx_block_left = ch->config.block_size;
+    ch->rx_state = RX_RECEIVING;
+    ch->rx_deadline = timestamp_get() + ISOTP_TIMEOUT;
+    send_flow_control(bus, FC_CONTINUE);
+}
+
+static void rx_consecutive(uint32_t bus, can_frame_t *frame) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint32_t len;
+    uint32_t i;
+
+    if (ch->rx_state != RX_RECEIVING) {
+        return;
+    }
+    if ((frame->data[0] & 0x0F) != ch->rx_sn) {
+        ch->rx_state = RX_IDLE;
+        ch->rx_result = ISOTP_RESULT_WRONG_SN;
+        return;
+    }
+
+    len = ch->rx_len - ch->rx_offset;
+    if (len > 7) {
+        len = 7;
+    }
+    if (frame->len < len + 1) {
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        ch->rx_data[ch->rx_offset + i] = frame->data[i + 1];
+    }
+    ch->rx_offset += len;
+    ch->rx_sn = (ch->rx_sn + 1) & 0x0F;
+    ch->rx_deadline = timestamp_get() + ISOTP_TIMEOUT;
+
+    if (ch->rx_offset >= ch->rx_len) {
+        ch->rx_state = RX_DONE;
+    } else if (ch->config.block_size > 0 && --ch->rx_block_left == 0) {
+        ch->rx_block_left = ch->config.block_size;
+        send_flow_control(bus, FC_CONTINUE);
+    }
+}
+
+// handle a received frame, called from the CAN ISR. true if the frame
+// belongs to the bus's connection.
+bool isotp_process(uint32_t bus, can_frame_t *frame) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint32_t len;
+    uint32_t i;
+
+    if (!ch->enabled || frame->id != ch->config.rx_id ||
+        (frame->flags & CAN_FRAME_EXTENDED) != ch->config.rx_flags ||
+        (frame->flags & CAN_FRAME_REMOTE) || frame->len == 0) {
+        return false;
+    }
+
+    if ((frame->data[0] & 0xF0) == PCI_FLOW_CONTROL) {
+        rx_flow_control(bus, frame);
+        return true;
+    }
+
+    if (ch->rx_state == RX_DONE) {
+        // the last PDU hasn't been read yet, the sender will time out
+        return true;
+    }
+
+    switch (frame->data[0] & 0xF0) {
+        case PCI_SINGLE:
+            len = frame->data[0] & 0x0F;
+            if (len == 0 || len > 7 || len + 1 > frame->len) {
+                break;
+            }
+            for (i = 0; i < len; i++) {
+                ch->rx_data[i] = frame->data[i + 1];
+            }
+            ch->rx_len = len;
+            ch->rx_state = RX_DONE;
+            break;
+        case PCI_FIRST:
+            rx_first(bus, frame);
+            break;
+        case PCI_CONSECUTIVE:
+            rx_consecutive(bus, frame);
+            break;
+    }
+
+    return true;
+}
+
+// get the result of the last send, ISOTP_RESULT_NONE while it is in
+// progress. each result is only returned once.
+uint32_t isotp_poll_tx(uint32_t bus) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint32_t result;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    if (ch->tx_state == TX_WAIT_FC && timestamp_get() > ch->tx_deadline) {
+        ch->tx_state = TX_IDLE;
+        ch->tx_result = ISOTP_RESULT_TIMEOUT;
+        ch->tx_len = 0;
+    }
+    result = ch->tx_result;
+    ch->tx_result = ISOTP_RESULT_NONE;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return result;
+}
+
+// get the result of receiving a PDU. on ISOTP_RESULT_DONE data and len are
+// set to the PDU, which stays valid until isotp_rx_release is called.
+// errors are only returned once.
+uint32_t isotp_poll_rx(uint32_t bus, uint8_t **data, uint32_t *len) {
+    isotp_channel_t *ch = &channels[bus - CAN_BUS_1];
+    uint32_t result;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    if (ch->rx_state == RX_RECEIVING && timestamp_get() > ch->rx_deadline) {
+        ch->rx_state = RX_IDLE;
+        ch->rx_result = ISOTP_RESULT_TIMEOUT;
+    }
+    if (ch->rx_state == RX_DONE) {
+        result = ISOTP_RESULT_DONE;
+        *data = ch->rx_data;
+        *len = ch->rx_len;
+    } else {
+        result = ch->rx_result;
+        ch->rx_result = ISOTP_RESULT_NONE;
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return result;
+}
+
+// let the next PDU be received once the last one has been read
+void isotp_rx_release(uint32_t bus) {
+    channels[bus - CAN_BUS_1].rx_state = RX_IDLE;
+}
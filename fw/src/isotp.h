@@ -0,0 +1,51 @@
+#ifndef _ISOTP_H_
+#define _ISOTP_H_
+
+#include "can.h"
+
+// largest PDU that can be sent or received, at most 4095
+#ifndef ISOTP_MAX_LEN
+#define ISOTP_MAX_LEN 1024
+#endif
+
+// byte unused frame bytes are padded with
+#define ISOTP_PAD_BYTE 0xCC
+
+// results reported for a transfer
+enum {
+    ISOTP_RESULT_NONE = 0,
+    ISOTP_RESULT_DONE,
+    // the other side took too long to send a flow control or a frame
+    ISOTP_RESULT_TIMEOUT,
+    // the PDU doesn't fit in the buffer, ours or the receiver's
+    ISOTP_RESULT_OVERFLOW,
+    // a consecutive frame was lost
+    ISOTP_RESULT_WRONG_SN
+};
+
+// a bus's ISO-TP connection. frames are sent with tx_id and received with
+// rx_id, either may be extended as given by the flags. block_size and
+// st_min are sent in flow control frames when receiving.
+typedef struct {
+    uint32_t tx_id;
+    uint32_t rx_id;
+    uint8_t tx_flags;
+    uint8_t rx_flags;
+    uint8_t block_size;
+    uint8_t st_min;
+    // pad frames to 8 bytes
+    bool padding;
+} isotp_config_t;
+
+void isotp_init(void);
+void isotp_configure(uint32_t, isotp_config_t*);
+void isotp_disable(uint32_t);
+bool isotp_write(uint32_t, uint8_t*, uint32_t);
+bool isotp_send(uint32_t);
+void isotp_abort(uint32_t);
+bool isotp_process(uint32_t, can_frame_t*);
+uint32_t isotp_poll_tx(uint32_t);
+uint32_t isotp_poll_rx(uint32_t, uint8_t**, uint32_t*);
+void isotp_rx_release(uint32_t);
+
+#endif
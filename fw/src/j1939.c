@@ -0,0 +1,367 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "driverlib/rom.h"
+#include "driverlib/interrupt.h"
+
+#include "can.h"
+#include "j1939.h"
+#include "timestamp.h"
+
+// J1939-21 transport protocol reassembly
+//
+// connection management (TP.CM) and data transfer (TP.DT) frames are
+// handled in the CAN ISR and not passed on, only completed messages are.
+// broadcast (BAM) transfers and connection mode transfers between other
+// nodes are followed by listening. connection mode transfers sent to the
+// bus's own address are answered with CTS and end of message ack frames.
+
+// parameter group formats of the transport frames
+#define PF_TP_CM 0xEC
+#define PF_TP_DT 0xEB
+
+// TP.CM control bytes
+#define CM_RTS 16
+#define CM_CTS 17
+#define CM_EOM_ACK 19
+#define CM_BAM 32
+#define CM_ABORT 255
+
+// abort reasons
+#define ABORT_RESOURCES 2
+#define ABORT_TIMEOUT 3
+#define ABORT_BAD_SEQUENCE 7
+
+// priority of frames sent in answer
+#define J1939_PRIORITY 7
+
+// longest time to wait for the next frame of a transfer (T2), in
+// microseconds
+#define J1939_TIMEOUT 1250000
+
+enum {
+    SESSION_FREE = 0,
+    SESSION_RECEIVING,
+    // reassembled, waiting for the main loop to read it
+    SESSION_DONE
+};
+
+typedef struct {
+    uint8_t state;
+    uint8_t bus;
+    uint8_t sa;
+    uint8_t da;
+    // true if this node receives the transfer and sends CTS
+    bool answer;
+    uint8_t packets;
+    uint8_t next_seq;
+    // most packets the sender wants per CTS, and packets left in this one
+    uint8_t max_per_cts;
+    uint8_t cts_left;
+    uint32_t pgn;
+    uint32_t size;
+    uint64_t deadline;
+    uint8_t data[J1939_MAX_SIZE];
+} session_t;
+
+static session_t sessions[J1939_MAX_SESSIONS];
+
+// per bus settings and counters, indexed by bus number - CAN_BUS_1
+static bool enabled[2];
+// address to answer connection mode transfers to, -1 for none
+static int32_t address[2] = {-1, -1};
+// transfers lost for lack of a free session, or broken off
+static uint32_t dropped[2];
+// session holding the message last returned by j1939_poll
+static session_t *reading[2];
+
+// enable or disable reassembly on a bus. disabling drops the bus's
+// transfers, except a message the main loop is part way through sending,
+// which is kept until j1939_release.
+void j1939_enable(uint32_t bus, bool enable) {
+    uint32_t i;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    enabled[bus - CAN_BUS_1] = enable;
+    if (!enable) {
+        for (i = 0; i < J1939_MAX_SESSIONS; i++) {
+            if (sessions[i].bus == bus &&
+                &sessions[i] != reading[bus - CAN_BUS_1]) {
+                sessions[i].state = SESSION_FREE;
+            }
+        }
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// set the address to answer connection mode transfers to, -1 to only
+// listen
+void j1939_set_address(uint32_t bus, int32_t addr) {
+    address[bus - CAN_BUS_1] = addr;
+}
+
+// send a TP.CM frame from this node to da about pgn
+static void send_cm(uint32_t bus, uint8_t da, uint8_t *data, uint32_t pgn) {
+    can_frame_t frame;
+
+    frame.id = (J1939_PRIORITY << 26) | (PF_TP_CM << 16) | (da << 8) |
+               address[bus - CAN_BUS_1];
+    frame.flags = CAN_FRAME_EXTENDED;
+    frame.len = 8;
+    frame.data[0] = data[0];
+    frame.data[1] = data[1];
+    frame.data[2] = data[2];
+    frame.data[3] = data[3];
+    frame.data[4] = data[4];
+    frame.data[5] = pgn & 0xFF;
+    frame.data[6] = (pgn >> 8) & 0xFF;
+    frame.data[7] = (pgn >> 16) & 0xFF;
+    can_send_frame(bus, &frame);
+}
+
+static void send_abort(uint32_t bus, uint8_t da, uint8_t reason,
+                       uint32_t pgn) {
+    uint8_t data[5] = {CM_ABORT, reason, 0xFF, 0xFF, 0xFF};
+
+    send_cm(bus, da, data, pgn);
+}
+
+// ask the sender for the next packets
+static void send_cts(session_t *s) {
+    uint8_t data[5] = {CM_CTS, 0, s->next_seq, 0xFF, 0xFF};
+
+    s->cts_left = s->packets - s->next_seq + 1;
+    if (s->cts_left > s->max_per_cts) {
+        s->cts_left = s->max_per_cts;
+    }
+    data[1] = s->cts_left;
+    send_cm(s->bus, s->sa, data, s->pgn);
+}
+
+// find the transfer from sa to da on a bus, NULL if there isn't one
+static session_t *find_session(uint32_t bus, uint8_t sa, uint8_t da) {
+    uint32_t i;
+
+    for (i = 0; i < J1939_MAX_SESSIONS; i++) {
+        if (sessions[i].state == SESSION_RECEIVING &&
+            sessions[i].bus == bus && sessions[i].sa == sa &&
+            sessions[i].da == da) {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+// start reassembling a transfer announced by a BAM or RTS frame
+static void start_session(uint32_t bus, uint8_t sa, uint8_t da,
+                          can_frame_t *frame) {
+    session_t *s;
+    uint32_t size;
+    uint32_t pgn;
+    bool answer;
+    uint32_t i;
+
+    size = frame->data[1] | (frame->data[2] << 8);
+    pgn = frame->data[5] | (frame->data[6] << 8) | (frame->data[7] << 16);
+    answer = frame->data[0] == CM_RTS && da == address[bus - CAN_BUS_1];
+
+    // a new announcement replaces a transfer between the same nodes
+    s = find_session(bus, sa, da);
+    for (i = 0; s == NULL && i < J1939_MAX_SESSIONS; i++) {
+        if (sessions[i].state == SESSION_FREE) {
+            s = &sessions[i];
+        }
+    }
+    if (s == NULL || size > J1939_MAX_SIZE || size < 9 ||
+        frame->data[3] != (size + 6) / 7) {
+        dropped[bus - CAN_BUS_1]++;
+        if (answer) {
+            send_abort(bus, sa, ABORT_RESOURCES, pgn);
+        }
+        return;
+    }
+
+    s->state = SESSION_RECEIVING;
+    s->bus = bus;
+    s->sa = sa;
+    s->da = da;
+    s->answer = answer;
+    s->packets = frame->data[3];
+    s->next_seq = 1;
+    s->max_per_cts = (frame->data[0] == CM_RTS) ? frame->data[4] : 0xFF;
+    if (s->max_per_cts == 0) {
+        s->max_per_cts = 0xFF;
+    }
+    s->pgn = pgn;
+    s->size = size;
+    s->deadline = timestamp_get() + J1939_TIMEOUT;
+    if (answer) {
+        send_cts(s);
+    }
+}
+
+static void rx_cm(uint32_t bus, uint8_t sa, uint8_t da, can_frame_t *frame) {
+    session_t *s;
+
+    switch (frame->data[0]) {
+        case CM_BAM:
+            if (da == J1939_GLOBAL) {
+                start_session(bus, sa, da, frame);
+            }
+            break;
+        case CM_RTS:
+            start_session(bus, sa, da, frame);
+            break;
+        case CM_CTS:
+            // sent by the receiver, so the transfer is from da to sa.
+            // keep a listened transfer alive while the receiver holds it.
+            s = find_session(bus, da, sa);
+            if (s != NULL && !s->answer) {
+                s->deadline = timestamp_get() + J1939_TIMEOUT;
+            }
+            break;
+        case CM_ABORT:
+            // either side may abort
+            s = find_session(bus, sa, da);
+            if (s == NULL) {
+                s = find_session(bus, da, sa);
+            }
+            if (s != NULL) {
+                s->state = SESSION_FREE;
+                dropped[bus - CAN_BUS_1]++;
+            }
+            break;
+    }
+}
+
+static void rx_dt(uint32_t bus, uint8_t sa, uint8_t da, can_frame_t *frame) {
+    session_t *s;
+    uint32_t offset;
+    uint32_t i;
+
+    s = find_session(bus, sa, da);
+    if (s == NULL || frame->len < 8) {
+        return;
+    }
+
+    if (frame->data[0] != s->next_seq) {
+        if (s->answer) {
+            send_abort(bus, sa, ABORT_BAD_SEQUENCE, s->pgn);
+        }
+        s->state = SESSION_FREE;
+        dropped[bus - CAN_BUS_1]++;
+        return;
+    }
+
+    offset = (s->next_seq - 1) * 7;
+    for (i = 0; i < 7 && offset + i < s->size; i++) {
+        s->data[offset + i] = frame->data[i + 1];
+    }
+    s->deadline = timestamp_get() + J1939_TIMEOUT;
+
+    if (s->next_seq == s->packets) {
+        if (s->answer) {
+            uint8_t data[5] = {CM_EOM_ACK, s->size & 0xFF, s->size >> 8,
+                               s->packets, 0xFF};
+            send_cm(bus, sa, data, s->pgn);
+        }
+        s->state = SESSION_DONE;
+        return;
+    }
+    s->next_seq++;
+
+    if (s->answer && --s->cts_left == 0) {
+        send_cts(s);
+    }
+}
+
+// handle a received frame, called from the CAN ISR. true if the frame is a
+// transport frame and shouldn't be passed on.
+bool j1939_process(uint32_t bus, can_frame_t *frame) {
+    uint32_t pf;
+    uint8_t da;
+    uint8_t sa;
+
+    if (!enabled[bus - CAN_BUS_1] || !(frame->flags & CAN_FRAME_EXTENDED) ||
+        (frame->flags & CAN_FRAME_REMOTE)) {
+        return false;
+    }
+
+    // PF along with the extended data page and data page bits, transport
+    // frames are on page 0 so PGN 0x1EC00 and the like don't match
+    pf = (frame->id >> 16) & 0x3FF;
+    da = (frame->id >> 8) & 0xFF;
+    sa = frame->id & 0xFF;
+
+    if (pf == PF_TP_CM) {
+        if (frame->len == 8) {
+            rx_cm(bus, sa, da, frame);
+        }
+        return true;
+    } else if (pf == PF_TP_DT) {
+        rx_dt(bus, sa, da, frame);
+        return true;
+    }
+
+    return false;
+}
+
+// get a reassembled message from a bus, false if there are none. the
+// message stays valid until j1939_release is called. transfers that timed
+// out are dropped.
+bool j1939_poll(uint32_t bus, j1939_message_t *msg) {
+    session_t *s;
+    uint64_t now;
+    uint32_t i;
+    bool found = false;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    now = timestamp_get();
+    for (i = 0; i < J1939_MAX_SESSIONS; i++) {
+        s = &sessions[i];
+        if (s->bus != bus) {
+            continue;
+        }
+        if (s->state == SESSION_RECEIVING && now > s->deadline) {
+            if (s->answer) {
+                send_abort(bus, s->sa, ABORT_TIMEOUT, s->pgn);
+            }
+            s->state = SESSION_FREE;
+            dropped[bus - CAN_BUS_1]++;
+        } else if (s->state == SESSION_DONE && !found &&
+                   (reading[bus - CAN_BUS_1] == NULL ||
+                    reading[bus - CAN_BUS_1] == s)) {
+            // keep returning the message being read until it is released
+            msg->pgn = s->pgn;
+            msg->sa = s->sa;
+            msg->da = s->da;
+            msg->size = s->size;
+            msg->data = s->data;
+            reading[bus - CAN_BUS_1] = s;
+            found = true;
+        }
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return found;
+}
+
+// free the message returned by the last j1939_poll on a bus
+void j1939_release(uint32_t bus) {
+    if (reading[bus - CAN_BUS_1] != NULL) {
+        reading[bus - CAN_BUS_1]->state = SESSION_FREE;
+        reading[bus - CAN_BUS_1] = NULL;
+    }
+}
+
+// number of transfers on a bus that were dropped or broken off
+uint32_t j1939_dropped(uint32_t bus) {
+    return dropped[bus - CAN_BUS_1];
+}
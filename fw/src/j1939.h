@@ -0,0 +1,34 @@
+#ifndef _J1939_H_
+#define _J1939_H_
+
+#include "can.h"
+
+// largest message the transport protocol carries, 255 packets of 7 bytes
+#define J1939_MAX_SIZE 1785
+
+// number of transfers that can be reassembled at once, shared by both
+// buses
+#ifndef J1939_MAX_SESSIONS
+#define J1939_MAX_SESSIONS 2
+#endif
+
+// address used by no node, as the destination of a broadcast
+#define J1939_GLOBAL 0xFF
+
+// a reassembled message, sent from sa to da
+typedef struct {
+    uint32_t pgn;
+    uint8_t sa;
+    uint8_t da;
+    uint32_t size;
+    uint8_t *data;
+} j1939_message_t;
+
+void j1939_enable(uint32_t, bool);
+void j1939_set_address(uint32_t, int32_t);
+bool j1939_process(uint32_t, can_frame_t*);
+bool j1939_poll(uint32_t, j1939_message_t*);
+void j1939_release(uint32_t);
+uint32_t j1939_dropped(uint32_t);
+
+#endif
@@ -32,7 +32,20 @@
 #include "usb_serial_structs.h"
 #include "usb.h"
 #include "can.h"
+#include "queue.h"
+#include "gateway.h"
+#include "periodic.h"
+#include "stream.h"
+#include "isotp.h"
+#include "j1939.h"
+#include "responder.h"
+#include "query.h"
+#include "filter.h"
+#include "record.h"
+#include "encode.h"
+#include "timestamp.h"
 #include "commands.h"
+#include "usb_gs.h"
 
 // define the systick period at 1 ms
 #define SYSTICKS_PER_SECOND 1000
@@ -89,7 +102,26 @@ void hw_init() {
     ROM_GPIOPinTypeCAN(GPIO_PORTE_BASE, GPIO_PIN_4 | GPIO_PIN_5);
     ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_CAN0);
 
-    // TODO: configure CAN1 pins and peripherial
+    // configure CAN1 pins and peripherial
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_GPIOA);
+    ROM_GPIOPinConfigure(GPIO_PA1_CAN1TX);
+    ROM_GPIOPinConfigure(GPIO_PA0_CAN1RX);
+    ROM_GPIOPinTypeCAN(GPIO_PORTA_BASE, GPIO_PIN_0 | GPIO_PIN_1);
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_CAN1);
+
+    // enable the timestamp timer
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_WTIMER5);
+
+    // enable the periodic transmit timer
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER0);
+
+    // enable the replay and txb stream timers
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER1);
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER4);
+
+    // enable the ISO-TP timers
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER2);
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER3);
 
     // enable systick
     ROM_SysTickPeriodSet(ROM_SysCtlClockGet() / SYSTICKS_PER_SECOND);
@@ -97,6 +129,7 @@ void hw_init() {
     ROM_SysTickEnable();
 }
 
+#ifndef GS_USB
 // callback for when a command is received over USB
 // decide which command should be executed, then run it
 void cmd_handler(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
@@ -111,18 +144,68 @@ void cmd_handler(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
     if (ustrcasecmp("tx", argv[0]) == 0) {
         status = cmd_tx(argc, argv);
     }
+    // command: txb
+    if (ustrcasecmp("txb", argv[0]) == 0) {
+        status = cmd_txb(argc, argv);
+    }
+    // command: replay
+    if (ustrcasecmp("replay", argv[0]) == 0) {
+        status = cmd_replay(argc, argv);
+    }
+    // command: isotp
+    if (ustrcasecmp("isotp", argv[0]) == 0) {
+        status = cmd_isotp(argc, argv);
+    }
+    // command: j1939
+    if (ustrcasecmp("j1939", argv[0]) == 0) {
+        status = cmd_j1939(argc, argv);
+    }
+    // command: respond
+    if (ustrcasecmp("respond", argv[0]) == 0) {
+        status = cmd_respond(argc, argv);
+    }
+    // command: query
+    if (ustrcasecmp("query", argv[0]) == 0) {
+        status = cmd_query(argc, argv);
+    }
+    // command: mode
+    if (ustrcasecmp("mode", argv[0]) == 0) {
+        status = cmd_mode(argc, argv);
+    }
+    // command: bench
+    if (ustrcasecmp("bench", argv[0]) == 0) {
+        status = cmd_bench(argc, argv);
+    }
+    // command: usb
+    if (ustrcasecmp("usb", argv[0]) == 0) {
+        status = cmd_usb(argc, argv);
+    }
+    // command: gw
+    if (ustrcasecmp("gw", argv[0]) == 0) {
+        status = cmd_gw(argc, argv);
+    }
+    // command: periodic
+    if (ustrcasecmp("periodic", argv[0]) == 0) {
+        status = cmd_periodic(argc, argv);
+    }
     // command: reset
     if (ustrcasecmp("reset", argv[0]) == 0) {
         status = cmd_reset(argc, argv);
         // never returns due to sw reset
     }
 
+    if (status == CMD_REPLIED) {
+        return;
+    }
+
     // handle errors
     if (status == CMD_ERROR_UNKNOWN_CMD) {
         // no commands matched
         usnprintf(resp, MAX_RESP_SIZE, "error: unknown command\r\n");
     } else if (status == CMD_ERROR_INVALID_ARG) {
         usnprintf(resp, MAX_RESP_SIZE, "error: invalid args\r\n");
+    } else if (status == CMD_ERROR_QUEUE_FULL) {
+        usnprintf(resp, MAX_RESP_SIZE, "error: queue full\r\n");
     } else {
         // no error
         usnprintf(resp, MAX_RESP_SIZE, "ok: %s\r\n", argv[0]);
@@ -130,39 +213,294 @@ void cmd_handler(int argc, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]) {
     // send response
     usb_send_str(resp);
 }
+#endif
+
+// frames received from each bus, waiting to be sent to the host
+queue_t rx_queue[2];
+
+// called from the CAN ISRs for every received frame
+void can_handler(uint32_t bus, can_frame_t *frame) {
+    // answer emulated requests before anything else
+    responder_process(bus, frame);
+    query_process(bus, frame);
+
+    // forward to the other bus straight from the ISR
+    gateway_process(bus, frame);
+
+    // ISO-TP and J1939 transport frames reach the host as whole messages
+    if (isotp_process(bus, frame) || j1939_process(bus, frame)) {
+        return;
+    }
+
+    // the capture filters only decide what reaches the host
+    if (!filter_accept(bus, frame)) {
+        return;
+    }
+
+    // the frame lives on the ISR's stack, the queue keeps a copy
+    queue_push(&rx_queue[bus - CAN_BUS_1], frame);
+}
+
+#ifndef GS_USB
+// space to leave in the USB transmit buffer before reporting results that
+// take up to two lines, so they aren't cut short
+#define OUTPUT_RESERVE (2 * MAX_RESP_SIZE)
+
+// send the next frame from a bus's queue to the host, if there is one.
+// the frame stays queued until it fits in the USB transmit buffer.
+//
+// the frame is encoded from its queue slot straight into the transmit
+// buffer. only when the line would run past the end of the buffer is it
+// encoded on the stack and copied in, wrapping around.
+static void send_rx(uint32_t bus) {
+    char line[ENCODE_RX_LINE_SIZE];
+    uint8_t *dest;
+    can_frame_t *frame;
+    uint32_t size;
+    uint32_t len;
+    bool binary;
+
+    frame = queue_front(&rx_queue[bus - CAN_BUS_1]);
+    if (!usb_tx_ready() || frame == NULL) {
+        return;
+    }
+
+    binary = record_binary();
+    size = binary ? RECORD_SIZE : ENCODE_RX_LINE_SIZE;
 
-volatile uint32_t pending_count = 0;
-volatile tCANMsgObject pending_msgs[500];
+    dest = usb_tx_reserve(size);
+    if (dest != NULL) {
+        if (binary) {
+            record_pack(dest, bus, frame);
+            len = RECORD_SIZE;
+        } else {
+            // the terminating null is written but not sent
+            len = encode_rx_line((char *)dest, bus, frame);
+        }
+        usb_tx_commit(len);
+    } else {
+        if (binary) {
+            record_pack((uint8_t *)line, bus, frame);
+            len = RECORD_SIZE;
+        } else {
+            len = encode_rx_line(line, bus, frame);
+        }
+        if (!usb_send((uint8_t *)line, len)) {
+            return;
+        }
+    }
 
-void can_handler(uint32_t bus, tCANMsgObject *msg) {
-    pending_msgs[pending_count] = *msg;
-    pending_count++;
+    queue_pop(&rx_queue[bus - CAN_BUS_1], NULL);
 }
 
+// report the outcome of a query to the host, as the request then the
+// response, each with its timestamp
+static void send_query(uint32_t bus) {
+    char resp[MAX_RESP_SIZE];
+    can_frame_t request;
+    can_frame_t response;
+    uint32_t result;
+    uint32_t pos;
+
+    if (usb_tx_space() < OUTPUT_RESERVE) {
+        return;
+    }
+
+    result = query_poll(bus, &request, &response);
+    if (result == QUERY_TIMEOUT) {
+        usnprintf(resp, MAX_RESP_SIZE, "error: query %d timeout\r\n", bus);
+        usb_send_str(resp);
+    } else if (result == QUERY_DONE) {
+        pos = usnprintf(resp, MAX_RESP_SIZE, "query %d ", bus);
+        pos += encode_frame(resp + pos, &request);
+        resp[pos++] = ' ';
+        pos += encode_frame(resp + pos, &response);
+        resp[pos++] = '\r';
+        resp[pos++] = '\n';
+        usb_send((uint8_t *)resp, pos);
+    }
+}
+
+// names of ISO-TP results, indexed by result
+static const char *isotp_results[] = {
+    "none", "done", "timeout", "overflow", "wrong sn"
+};
+
+// send the next line of a reassembled message to the host, up to
+// DATA_LINE_BYTES bytes from offset sent, and advance sent
+#define DATA_LINE_BYTES 32
+static void send_data_line(const char *name, uint32_t bus, uint8_t *data,
+                           uint32_t len, uint32_t *sent) {
+    char resp[MAX_RESP_SIZE];
+    uint32_t pos;
+    uint32_t count;
+
+    pos = usnprintf(resp, MAX_RESP_SIZE, "%s %d data ", name, bus);
+    // lower case hex, like the rx lines
+    count = len - *sent;
+    if (count > DATA_LINE_BYTES) {
+        count = DATA_LINE_BYTES;
+    }
+    pos += encode_bytes(resp + pos, data + *sent, count);
+    *sent += count;
+    resp[pos++] = '\r';
+    resp[pos++] = '\n';
+    resp[pos] = '\0';
+    usb_send_str(resp);
+}
+
+// bytes of a received ISO-TP PDU sent to the host so far, per bus
+static uint32_t isotp_sent[2];
+
+// report ISO-TP results to the host. a received PDU is sent as a header
+// line then data lines, one line per call so received frames keep flowing.
+static void send_isotp(uint32_t bus) {
+    char resp[MAX_RESP_SIZE];
+    uint32_t *sent = &isotp_sent[bus - CAN_BUS_1];
+    uint32_t result;
+    uint8_t *data;
+    uint32_t len;
+
+    if (usb_tx_space() < OUTPUT_RESERVE) {
+        return;
+    }
+
+    result = isotp_poll_tx(bus);
+    if (result == ISOTP_RESULT_DONE) {
+        usnprintf(resp, MAX_RESP_SIZE, "isotp %d sent\r\n", bus);
+        usb_send_str(resp);
+    } else if (result != ISOTP_RESULT_NONE) {
+        usnprintf(resp, MAX_RESP_SIZE, "error: isotp %d tx %s\r\n", bus,
+                  isotp_results[result]);
+        usb_send_str(resp);
+    }
+
+    result = isotp_poll_rx(bus, &data, &len);
+    if (result == ISOTP_RESULT_NONE) {
+        return;
+    } else if (result != ISOTP_RESULT_DONE) {
+        usnprintf(resp, MAX_RESP_SIZE, "error: isotp %d rx %s\r\n", bus,
+                  isotp_results[result]);
+        usb_send_str(resp);
+        return;
+    }
+
+    if (*sent == 0) {
+        usnprintf(resp, MAX_RESP_SIZE, "isotp %d rx %u\r\n", bus, len);
+        usb_send_str(resp);
+    }
+
+    send_data_line("isotp", bus, data, len, sent);
+    if (*sent >= len) {
+        *sent = 0;
+        isotp_rx_release(bus);
+    }
+}
+
+// bytes of a reassembled J1939 message sent to the host so far, per bus
+static uint32_t j1939_sent[2];
+
+// send reassembled J1939 messages to the host, as a header line with the
+// PGN, source and destination addresses and size, then data lines
+static void send_j1939(uint32_t bus) {
+    char resp[MAX_RESP_SIZE];
+    uint32_t *sent = &j1939_sent[bus - CAN_BUS_1];
+    j1939_message_t msg;
+
+    if (usb_tx_space() < OUTPUT_RESERVE || !j1939_poll(bus, &msg)) {
+        return;
+    }
+
+    if (*sent == 0) {
+        usnprintf(resp, MAX_RESP_SIZE, "j1939 %d %05X %02X %02X %u\r\n",
+                  bus, msg.pgn, msg.sa, msg.da, msg.size);
+        usb_send_str(resp);
+    }
+
+    send_data_line("j1939", bus, msg.data, msg.size, sent);
+    if (*sent >= msg.size) {
+        *sent = 0;
+        j1939_release(bus);
+    }
+}
+#endif
+
 int main(void)
 {
+    uint32_t bus;
+#ifdef GS_USB
+    can_frame_t *frame;
+#else
     char resp[MAX_RESP_SIZE];
-    volatile tCANMsgObject msg;
+    uint32_t reported_overruns[2] = {0, 0};
+    uint32_t reported_dropped = 0;
+    uint32_t len;
+#endif
+
+    queue_init(&rx_queue[0]);
+    queue_init(&rx_queue[1]);
 
     hw_init();
+    timestamp_init();
+#ifdef GS_USB
+    usb_gs_init();
+#else
     usb_init(cmd_handler);
+#endif
     can_init(can_handler);
+    periodic_init();
+    stream_init();
+    isotp_init();
 
+#ifdef GS_USB
+    // the host drives the buses through the gs_usb driver, and frames go
+    // both ways as binary host frames
+    while (1) {
+        usb_gs_poll();
+        for (bus = CAN_BUS_1; bus <= CAN_BUS_2; bus++) {
+            frame = queue_front(&rx_queue[bus - CAN_BUS_1]);
+            if (frame != NULL && usb_gs_send(bus, frame)) {
+                queue_pop(&rx_queue[bus - CAN_BUS_1], NULL);
+            }
+        }
+    }
+#else
     // main loop
     while(1)
     {
-        if (pending_count > 0) {
-            IntMasterDisable();
-            pending_count--;
-            msg = pending_msgs[pending_count];
-            usnprintf(resp, MAX_RESP_SIZE,
-                        "rx %03X%d%02X%02X%02X%02X%02X%02X%02X%02X\r\n",
-                        msg.ui32MsgID, msg.ui32MsgLen, msg.pui8MsgData[0],
-                        msg.pui8MsgData[1], msg.pui8MsgData[2], msg.pui8MsgData[3],
-                        msg.pui8MsgData[4], msg.pui8MsgData[5], msg.pui8MsgData[6],
-                        msg.pui8MsgData[7]);
-            usb_send_str(resp);
-            IntMasterEnable();
+        for (bus = CAN_BUS_1; bus <= CAN_BUS_2; bus++) {
+            // alternate between the buses so neither can starve the other
+            send_rx(bus);
+            send_isotp(bus);
+            send_j1939(bus);
+            send_query(bus);
+
+            // let the host know that frames were lost. reports are sent
+            // again until they fit, without counting as dropped output.
+            if (rx_queue[bus - CAN_BUS_1].overruns !=
+                    reported_overruns[bus - CAN_BUS_1]) {
+                len = usnprintf(resp, MAX_RESP_SIZE,
+                                "error: rx %d overrun %u\r\n", bus,
+                                rx_queue[bus - CAN_BUS_1].overruns);
+                if (usb_send((uint8_t *)resp, len)) {
+                    reported_overruns[bus - CAN_BUS_1] =
+                        rx_queue[bus - CAN_BUS_1].overruns;
+                }
+            }
+        }
+
+        // and that responses were lost
+        if (usb_tx_dropped() != reported_dropped) {
+            len = usnprintf(resp, MAX_RESP_SIZE, "error: usb dropped %u\r\n",
+                            usb_tx_dropped());
+            if (usb_send((uint8_t *)resp, len)) {
+                reported_dropped = usb_tx_dropped();
+            }
         }
+
+        // send output held back for a full packet once it has waited long
+        // enough
+        usb_tx_poll();
     }
+#endif
 }
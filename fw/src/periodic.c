@@ -0,0 +1,230 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "inc/hw_ints.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
+
+#include "driverlib/interrupt.h"
+#include "driverlib/rom.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+
+#include "can.h"
+#include "periodic.h"
+#include "timestamp.h"
+
+// cyclic frame scheduler
+//
+// every entry keeps the timestamp its next frame is due at. timer 0 runs
+// as a one shot at the system clock, loaded with the time to the earliest
+// due frame. deadlines are kept on the timestamp time base rather than
+// counted in timer periods, so the time spent in the ISR doesn't add up.
+#define PERIODIC_TIMER_BASE TIMER0_BASE
+
+// longest time to load the timer with, in microseconds. entries with a
+// longer wait are checked again after this.
+#define PERIODIC_MAX_WAIT 1000000
+
+typedef struct {
+    bool active;
+    periodic_entry_t entry;
+    // timestamp the next frame is due at
+    uint64_t due;
+} periodic_slot_t;
+
+static periodic_slot_t slots[PERIODIC_MAX_ENTRIES];
+
+// a frame to send once, for internal users like the responder. these
+// don't show up in or get removed with the cyclic frames.
+typedef struct {
+    bool active;
+    uint8_t bus;
+    can_frame_t frame;
+    uint64_t due;
+} delayed_slot_t;
+
+static delayed_slot_t delayed[PERIODIC_MAX_DELAYED];
+
+// timer ticks per microsecond
+static uint32_t ticks_per_us;
+
+// send every frame that is due and load the timer for the next one,
+// interrupts must be off
+static void schedule(void) {
+    periodic_slot_t *slot;
+    delayed_slot_t *once;
+    uint64_t now;
+    uint64_t next;
+    uint32_t i;
+
+    TimerDisable(PERIODIC_TIMER_BASE, TIMER_A);
+
+    while (1) {
+        now = timestamp_get();
+        next = now + PERIODIC_MAX_WAIT;
+
+        for (i = 0; i < PERIODIC_MAX_ENTRIES; i++) {
+            slot = &slots[i];
+            if (!slot->active) {
+                continue;
+            }
+
+            if (slot->due <= now) {
+                // a full queue only costs this frame, the cycle carries on
+                can_send_frame(slot->entry.bus, &slot->entry.frame);
+
+                if (slot->entry.count > 0 && --slot->entry.count == 0) {
+                    slot->active = false;
+                    continue;
+                }
+
+                slot->due += slot->entry.period;
+                if (slot->due <= now) {
+                    // fell more than a period behind, skip the missed frames
+                    // rather than sending them back to back
+                    slot->due = now + slot->entry.period;
+                }
+            }
+
+            if (slot->due < next) {
+                next = slot->due;
+            }
+        }
+
+        for (i = 0; i < PERIODIC_MAX_DELAYED; i++) {
+            once = &delayed[i];
+            if (!once->active) {
+                continue;
+            }
+            if (once->due <= now) {
+                can_send_frame(once->bus, &once->frame);
+                once->active = false;
+            } else if (once->due < next) {
+                next = once->due;
+            }
+        }
+
+        // the sends may have taken long enough for the next frame to be due
+        now = timestamp_get();
+        if (next > now) {
+            break;
+        }
+    }
+
+    TimerLoadSet(PERIODIC_TIMER_BASE, TIMER_A,
+                 (uint32_t) (next - now) * ticks_per_us);
+    TimerEnable(PERIODIC_TIMER_BASE, TIMER_A);
+}
+
+static void periodic_isr(void) {
+    TimerIntClear(PERIODIC_TIMER_BASE, TIMER_TIMA_TIMEOUT);
+    schedule();
+}
+
+void periodic_init(void) {
+    // wait here if the peripherial isn't enabled
+    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_TIMER0));
+
+    ticks_per_us = SysCtlClockGet() / 1000000;
+
+    TimerConfigure(PERIODIC_TIMER_BASE, TIMER_CFG_ONE_SHOT);
+    TimerIntRegister(PERIODIC_TIMER_BASE, TIMER_A, periodic_isr);
+    TimerIntEnable(PERIODIC_TIMER_BASE, TIMER_TIMA_TIMEOUT);
+}
+
+// add a cyclic frame, returns its index or -1 if the table is full
+int32_t periodic_add(periodic_entry_t *entry) {
+    int32_t i;
+    bool ints_off;
+
+    if (entry->period == 0) {
+        return -1;
+    }
+
+    // the table is read from the timer ISR
+    ints_off = ROM_IntMasterDisable();
+    for (i = 0; i < PERIODIC_MAX_ENTRIES; i++) {
+        if (!slots[i].active) {
+            slots[i].entry = *entry;
+            slots[i].due = timestamp_get() + entry->phase;
+            slots[i].active = true;
+            schedule();
+            break;
+        }
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return (i < PERIODIC_MAX_ENTRIES) ? i : -1;
+}
+
+// stop sending a cyclic frame, false if there is none at index
+bool periodic_remove(uint32_t index) {
+    bool removed;
+
+    if (index >= PERIODIC_MAX_ENTRIES) {
+        return false;
+    }
+
+    // the timer is left running and finds nothing to do
+    removed = slots[index].active;
+    slots[index].active = false;
+    return removed;
+}
+
+// stop sending all cyclic frames on a bus
+void periodic_clear(uint32_t bus) {
+    uint32_t i;
+
+    for (i = 0; i < PERIODIC_MAX_ENTRIES; i++) {
+        if (slots[i].entry.bus == bus) {
+            slots[i].active = false;
+        }
+    }
+}
+
+// copy the cyclic frame at index, false if there is none. count is the
+// number of frames left to send.
+bool periodic_get(uint32_t index, periodic_entry_t *entry) {
+    bool ints_off;
+    bool active;
+
+    if (index >= PERIODIC_MAX_ENTRIES) {
+        return false;
+    }
+
+    ints_off = ROM_IntMasterDisable();
+    active = slots[index].active;
+    *entry = slots[index].entry;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return active;
+}
+
+// send a frame once, delay microseconds from now. false if too many
+// frames are already waiting. may be called from any context.
+bool periodic_delay(uint32_t bus, can_frame_t *frame, uint32_t delay) {
+    uint32_t i;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    for (i = 0; i < PERIODIC_MAX_DELAYED; i++) {
+        if (!delayed[i].active) {
+            delayed[i].bus = bus;
+            delayed[i].frame = *frame;
+            delayed[i].due = timestamp_get() + delay;
+            delayed[i].active = true;
+            schedule();
+            break;
+        }
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return i < PERIODIC_MAX_DELAYED;
+}
@@ -0,0 +1,31 @@
+#ifndef _PERIODIC_H_
+#define _PERIODIC_H_
+
+#include "can.h"
+
+// maximum number of cyclic frames, shared by both buses
+#define PERIODIC_MAX_ENTRIES 16
+
+// maximum number of single delayed frames waiting to be sent, kept apart
+// from the cyclic frames
+#define PERIODIC_MAX_DELAYED 8
+
+// a frame sent every period microseconds, the first one phase microseconds
+// after it is added. count is the number of frames left to send, 0 to send
+// until removed.
+typedef struct {
+    uint8_t bus;
+    can_frame_t frame;
+    uint32_t period;
+    uint32_t count;
+    uint32_t phase;
+} periodic_entry_t;
+
+void periodic_init(void);
+int32_t periodic_add(periodic_entry_t*);
+bool periodic_remove(uint32_t);
+void periodic_clear(uint32_t);
+bool periodic_get(uint32_t, periodic_entry_t*);
+bool periodic_delay(uint32_t, can_frame_t*, uint32_t);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driverlib/rom.h"
+#include "driverlib/interrupt.h"
+
+#include "can.h"
+#include "query.h"
+#include "timestamp.h"
+
+// request/response queries, one per bus
+//
+// a query sends a request and waits for the first frame whose id matches
+// under a mask. the response is picked out in the CAN ISR, and the main
+// loop reports it or the timeout.
+typedef struct {
+    uint8_t state;
+    uint8_t id_flags;
+    uint32_t id;
+    uint32_t mask;
+    uint64_t deadline;
+    // timestamp is when the request was queued
+    can_frame_t request;
+    can_frame_t response;
+} query_t;
+
+// indexed by bus number - CAN_BUS_1
+static query_t queries[2];
+
+// send a request and wait up to timeout microseconds for a response with
+// an id of the type in id_flags matching id under mask. false if a query
+// is already waiting on the bus or the transmit queue is full.
+bool query_start(uint32_t bus, can_frame_t *request, uint32_t id,
+                 uint32_t mask, uint32_t id_flags, uint32_t timeout) {
+    query_t *q = &queries[bus - CAN_BUS_1];
+    bool started = false;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    if (q->state != QUERY_WAITING) {
+        q->request = *request;
+        q->request.timestamp = timestamp_get();
+        q->id = id & mask;
+        q->mask = mask;
+        q->id_flags = id_flags;
+        q->deadline = q->request.timestamp + timeout;
+        q->state = QUERY_WAITING;
+        started = can_send_frame(bus, request);
+        if (!started) {
+            q->state = QUERY_IDLE;
+        }
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return started;
+}
+
+// check a received frame against the query waiting on bus, called from
+// the CAN ISR
+void query_process(uint32_t bus, can_frame_t *frame) {
+    query_t *q = &queries[bus - CAN_BUS_1];
+
+    if (q->state == QUERY_WAITING &&
+        ((frame->id & q->mask) == q->id) &&
+        (frame->flags & CAN_FRAME_EXTENDED) == q->id_flags) {
+        q->response = *frame;
+        q->state = QUERY_DONE;
+    }
+}
+
+// get the outcome of the query on bus. QUERY_DONE and QUERY_TIMEOUT are
+// only returned once, with the request and, when done, the response.
+uint32_t query_poll(uint32_t bus, can_frame_t *request,
+                    can_frame_t *response) {
+    query_t *q = &queries[bus - CAN_BUS_1];
+    uint32_t state;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    if (q->state == QUERY_WAITING && timestamp_get() > q->deadline) {
+        q->state = QUERY_TIMEOUT;
+    }
+    state = q->state;
+    if (state == QUERY_DONE || state == QUERY_TIMEOUT) {
+        *request = q->request;
+        *response = q->response;
+        q->state = QUERY_IDLE;
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return state;
+}
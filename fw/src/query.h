@@ -0,0 +1,22 @@
+#ifndef _QUERY_H_
+#define _QUERY_H_
+
+#include "can.h"
+
+// default time to wait for a response, in microseconds
+#define QUERY_DEFAULT_TIMEOUT 100000
+
+// query states, as returned by query_poll
+enum {
+    QUERY_IDLE = 0,
+    QUERY_WAITING,
+    QUERY_DONE,
+    QUERY_TIMEOUT
+};
+
+bool query_start(uint32_t, can_frame_t*, uint32_t, uint32_t, uint32_t,
+                 uint32_t);
+void query_process(uint32_t, can_frame_t*);
+uint32_t query_poll(uint32_t, can_frame_t*, can_frame_t*);
+
+#endif
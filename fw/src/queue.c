@@ -0,0 +1,65 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+#define QUEUE_MASK (QUEUE_SIZE - 1)
+
+void queue_init(queue_t *queue) {
+    queue->head = 0;
+    queue->tail = 0;
+    queue->overruns = 0;
+}
+
+// add a frame to the queue, only to be called by the producer
+bool queue_push(queue_t *queue, const can_frame_t *frame) {
+    uint32_t head = queue->head;
+
+    if (head - queue->tail >= QUEUE_SIZE) {
+        // full, drop the new frame and keep the ones already queued
+        queue->overruns++;
+        return false;
+    }
+
+    queue->frames[head & QUEUE_MASK] = *frame;
+    // publish the frame only once it has been completely written
+    __asm volatile ("dmb" ::: "memory");
+    queue->head = head + 1;
+
+    return true;
+}
+
+// remove the oldest frame from the queue, only to be called by the consumer.
+// frame may be NULL to drop it without copying.
+bool queue_pop(queue_t *queue, can_frame_t *frame) {
+    uint32_t tail = queue->tail;
+
+    if (queue->head == tail) {
+        // empty
+        return false;
+    }
+
+    if (frame != NULL) {
+        *frame = queue->frames[tail & QUEUE_MASK];
+    }
+    // release the slot only once the frame has been completely read
+    __asm volatile ("dmb" ::: "memory");
+    queue->tail = tail + 1;
+
+    return true;
+}
+
+// get the oldest frame in place, NULL if the queue is empty. it stays valid
+// until it is popped. only to be called by the consumer.
+can_frame_t *queue_front(queue_t *queue) {
+    if (queue->head == queue->tail) {
+        return NULL;
+    }
+
+    return &queue->frames[queue->tail & QUEUE_MASK];
+}
+
+uint32_t queue_count(queue_t *queue) {
+    return queue->head - queue->tail;
+}
@@ -0,0 +1,28 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include "can.h"
+
+// number of frames held by a queue, must be a power of 2
+#define QUEUE_SIZE 128
+
+// single producer, single consumer frame queue
+//
+// the producer (an ISR) only writes head, the consumer (the main loop) only
+// writes tail, so neither side needs to disable interrupts. the indices run
+// freely and are masked on access, so head - tail is always the fill level.
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    // frames dropped because the queue was full
+    volatile uint32_t overruns;
+    can_frame_t frames[QUEUE_SIZE];
+} queue_t;
+
+void queue_init(queue_t*);
+bool queue_push(queue_t*, const can_frame_t*);
+bool queue_pop(queue_t*, can_frame_t*);
+can_frame_t *queue_front(queue_t*);
+uint32_t queue_count(queue_t*);
+
+#endif
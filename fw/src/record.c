@@ -0,0 +1,35 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "can.h"
+#include "record.h"
+
+// true to send received frames as binary records instead of rx lines
+static volatile bool binary = false;
+
+void record_set_binary(bool enable) {
+    binary = enable;
+}
+
+bool record_binary(void) {
+    return binary;
+}
+
+// pack a frame received on bus into RECORD_SIZE bytes at buf
+void record_pack(uint8_t *buf, uint32_t bus, can_frame_t *frame) {
+    uint32_t i;
+
+    buf[0] = RECORD_SYNC_1;
+    buf[1] = RECORD_SYNC_2;
+    buf[2] = (bus << 4) | (frame->flags & 0x0F);
+    buf[3] = frame->len;
+    for (i = 0; i < 4; i++) {
+        buf[4 + i] = frame->id >> (i * 8);
+    }
+    for (i = 0; i < 8; i++) {
+        buf[8 + i] = frame->data[i];
+    }
+    for (i = 0; i < 8; i++) {
+        buf[16 + i] = frame->timestamp >> (i * 8);
+    }
+}
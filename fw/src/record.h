@@ -0,0 +1,29 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include "can.h"
+
+// binary frame records
+//
+// in binary mode each received frame is sent to the host as a fixed size
+// record, all multi-byte fields little endian:
+//
+//   0-1    RECORD_SYNC_1, RECORD_SYNC_2
+//   2      bus number in the high nibble, CAN_FRAME_* flags in the low
+//   3      data length
+//   4-7    id
+//   8-15   data, unused bytes 0
+//   16-23  timestamp in microseconds
+//
+// other output, like command responses, stays text. text never contains
+// RECORD_SYNC_1, so a host finds the next record by looking for the two
+// sync bytes and reads everything else up to a newline as a text line.
+#define RECORD_SIZE 24
+#define RECORD_SYNC_1 0xAA
+#define RECORD_SYNC_2 0x55
+
+void record_set_binary(bool);
+bool record_binary(void);
+void record_pack(uint8_t*, uint32_t, can_frame_t*);
+
+#endif
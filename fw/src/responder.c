@@ -0,0 +1,107 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driverlib/rom.h"
+#include "driverlib/interrupt.h"
+
+#include "can.h"
+#include "periodic.h"
+#include "responder.h"
+
+// rule table, rules[0] to rules[rule_count - 1] are in use
+static responder_rule_t rules[RESPONDER_MAX_RULES];
+static uint32_t rule_count = 0;
+
+// frames answered, indexed by bus number - CAN_BUS_1
+static uint32_t answered[2];
+
+// append a rule to the table, false if the table is full
+bool responder_add_rule(responder_rule_t *rule) {
+    bool ints_off;
+
+    if (rule_count >= RESPONDER_MAX_RULES) {
+        return false;
+    }
+
+    // the table is read from the CAN ISRs
+    ints_off = ROM_IntMasterDisable();
+    rules[rule_count] = *rule;
+    rule_count++;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return true;
+}
+
+// remove all rules for frames from a bus
+void responder_clear_rules(uint32_t bus) {
+    uint32_t i;
+    uint32_t kept = 0;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    for (i = 0; i < rule_count; i++) {
+        if (rules[i].bus != bus) {
+            rules[kept] = rules[i];
+            kept++;
+        }
+    }
+    rule_count = kept;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// number of frames answered on a bus
+uint32_t responder_answered(uint32_t bus) {
+    return answered[bus - CAN_BUS_1];
+}
+
+static bool rule_matches(responder_rule_t *rule, can_frame_t *frame) {
+    uint32_t i;
+
+    if (((frame->id ^ rule->id) & rule->mask) != 0 ||
+        (frame->flags & CAN_FRAME_EXTENDED) != rule->id_flags) {
+        return false;
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (rule->data_mask[i] == 0) {
+            continue;
+        }
+        // bytes the rule looks at must be in the frame
+        if (i >= frame->len ||
+            ((frame->data[i] ^ rule->data[i]) & rule->data_mask[i]) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// answer a frame received on bus, called from the CAN ISR
+//
+// the first matching rule's response is queued straight away, or handed
+// to the periodic scheduler's delay queue if the rule has a delay.
+void responder_process(uint32_t bus, can_frame_t *frame) {
+    responder_rule_t *rule;
+    uint32_t i;
+
+    for (i = 0; i < rule_count; i++) {
+        rule = &rules[i];
+        if (rule->bus != bus || !rule_matches(rule, frame)) {
+            continue;
+        }
+
+        if (rule->delay == 0) {
+            if (!can_send_frame(bus, &rule->response)) {
+                return;
+            }
+        } else if (!periodic_delay(bus, &rule->response, rule->delay)) {
+            return;
+        }
+        answered[bus - CAN_BUS_1]++;
+        return;
+    }
+}
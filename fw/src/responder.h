@@ -0,0 +1,29 @@
+#ifndef _RESPONDER_H_
+#define _RESPONDER_H_
+
+#include "can.h"
+
+// maximum number of rules, shared by both buses
+#define RESPONDER_MAX_RULES 16
+
+// a rule answering frames on bus of the id type in id_flags whose id
+// matches id in the bits set in mask and whose data matches data in the
+// bits set in data_mask. the response is sent on the same bus, delay
+// microseconds later.
+typedef struct {
+    uint8_t bus;
+    uint8_t id_flags;
+    uint32_t id;
+    uint32_t mask;
+    uint8_t data[8];
+    uint8_t data_mask[8];
+    uint32_t delay;
+    can_frame_t response;
+} responder_rule_t;
+
+bool responder_add_rule(responder_rule_t*);
+void responder_clear_rules(uint32_t);
+uint32_t responder_answered(uint32_t);
+void responder_process(uint32_t, can_frame_t*);
+
+#endif
@@ -0,0 +1,295 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "inc/hw_ints.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
+
+#include "driverlib/interrupt.h"
+#include "driverlib/rom.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+
+#include "can.h"
+#include "stream.h"
+#include "timestamp.h"
+
+// timed transmit streams
+//
+// frames are sent in the order they were pushed, each one gap microseconds
+// after the one before it, scaled by the stream's speed. each stream has a
+// one shot timer at the system clock that wakes it when the next frame is
+// due, or to retry when the bus's transmit queue is full: timer 1 for the
+// replay stream, timer 4 for txb. frames are held back rather than dropped
+// when the transmit queue is full.
+//
+// frames from base to head stay in the buffer while there are passes left
+// to loop over them. on the last pass each frame is freed once sent, so
+// the host can keep refilling the buffer as it drains. only the replay
+// stream is ever looped, sped up or paused, txb always sends each frame
+// once at its own timing.
+
+// time to wait before trying again when the transmit queue is full, in
+// microseconds. about one frame at 1 Mbit/s.
+#define STREAM_RETRY 50
+
+// longest time to load the timer with, in microseconds. longer gaps are
+// waited out in several steps.
+#define STREAM_MAX_WAIT 1000000
+
+typedef struct {
+    uint8_t bus;
+    // microseconds after the previous frame to send this one
+    uint32_t gap;
+    can_frame_t frame;
+} stream_entry_t;
+
+typedef struct {
+    uint32_t timer_base;
+    stream_entry_t *entries;
+    // number of entries, a power of 2
+    uint32_t size;
+    // frames are pushed at head and sent from tail. base is the first
+    // frame that hasn't been freed.
+    uint32_t head;
+    uint32_t tail;
+    uint32_t base;
+
+    // passes left, 0 to loop until cleared
+    uint32_t loops;
+    // percent of the original speed
+    uint32_t speed;
+    bool paused;
+    // timestamp the last frame was sent at
+    uint64_t last_sent;
+    // true while the timer is waiting for the next frame
+    bool running;
+    uint32_t sent;
+} stream_t;
+
+static stream_entry_t replay_entries[STREAM_REPLAY_SIZE];
+static stream_entry_t txb_entries[STREAM_TXB_SIZE];
+
+static stream_t streams[STREAM_COUNT];
+
+// timer ticks per microsecond
+static uint32_t ticks_per_us;
+
+static void wait(stream_t *st, uint64_t us) {
+    if (us > STREAM_MAX_WAIT) {
+        us = STREAM_MAX_WAIT;
+    }
+    TimerLoadSet(st->timer_base, TIMER_A, (uint32_t) us * ticks_per_us);
+    TimerEnable(st->timer_base, TIMER_A);
+    st->running = true;
+}
+
+// send every frame that is due, then wait for the next one. interrupts
+// must be off.
+static void run(stream_t *st) {
+    stream_entry_t *entry;
+    uint64_t now;
+    uint64_t due;
+
+    st->running = false;
+    while (!st->paused) {
+        if (st->tail == st->head) {
+            if (st->loops == 1 || st->base == st->head) {
+                return;
+            }
+            // start the next pass
+            if (st->loops > 1) {
+                st->loops--;
+            }
+            st->tail = st->base;
+        }
+        entry = &st->entries[st->tail & (st->size - 1)];
+
+        now = timestamp_get();
+        due = st->last_sent +
+              (uint64_t) entry->gap * STREAM_SPEED_NORMAL / st->speed;
+        if (due > now) {
+            wait(st, due - now);
+            return;
+        }
+
+        if (can_tx_space(entry->bus) == 0) {
+            wait(st, STREAM_RETRY);
+            return;
+        }
+        can_send_frame(entry->bus, &entry->frame);
+        st->sent++;
+        // time the next gap from when this frame was due, so late frames
+        // don't push back the ones after them
+        st->last_sent = (entry->gap > 0) ? due : now;
+        st->tail++;
+        if (st->loops == 1) {
+            st->base = st->tail;
+        }
+    }
+}
+
+static void timer1_isr(void) {
+    TimerIntClear(TIMER1_BASE, TIMER_TIMA_TIMEOUT);
+    run(&streams[STREAM_REPLAY]);
+}
+
+static void timer4_isr(void) {
+    TimerIntClear(TIMER4_BASE, TIMER_TIMA_TIMEOUT);
+    run(&streams[STREAM_TXB]);
+}
+
+void stream_init(void) {
+    uint32_t i;
+
+    // wait here if the peripherials aren't enabled
+    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_TIMER1));
+    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_TIMER4));
+
+    ticks_per_us = SysCtlClockGet() / 1000000;
+
+    streams[STREAM_REPLAY].timer_base = TIMER1_BASE;
+    streams[STREAM_REPLAY].entries = replay_entries;
+    streams[STREAM_REPLAY].size = STREAM_REPLAY_SIZE;
+    streams[STREAM_TXB].timer_base = TIMER4_BASE;
+    streams[STREAM_TXB].entries = txb_entries;
+    streams[STREAM_TXB].size = STREAM_TXB_SIZE;
+    for (i = 0; i < STREAM_COUNT; i++) {
+        streams[i].loops = 1;
+        streams[i].speed = STREAM_SPEED_NORMAL;
+    }
+
+    TimerConfigure(TIMER1_BASE, TIMER_CFG_ONE_SHOT);
+    TimerIntRegister(TIMER1_BASE, TIMER_A, timer1_isr);
+    TimerIntEnable(TIMER1_BASE, TIMER_TIMA_TIMEOUT);
+
+    TimerConfigure(TIMER4_BASE, TIMER_CFG_ONE_SHOT);
+    TimerIntRegister(TIMER4_BASE, TIMER_A, timer4_isr);
+    TimerIntEnable(TIMER4_BASE, TIMER_TIMA_TIMEOUT);
+}
+
+// number of frames that can be pushed before the stream is full
+uint32_t stream_space(uint32_t stream) {
+    stream_t *st = &streams[stream];
+
+    return st->size - (st->head - st->base);
+}
+
+// add a frame to send gap microseconds after the previous one, false if
+// the stream is full. the frame isn't sent until stream_start is called.
+bool stream_push(uint32_t stream, uint32_t bus, can_frame_t *frame,
+                 uint32_t gap) {
+    stream_t *st = &streams[stream];
+    stream_entry_t *entry;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    if (stream_space(stream) == 0) {
+        if (!ints_off) {
+            ROM_IntMasterEnable();
+        }
+        return false;
+    }
+
+    entry = &st->entries[st->head & (st->size - 1)];
+    entry->bus = bus;
+    entry->gap = gap;
+    entry->frame = *frame;
+    st->head++;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return true;
+}
+
+// send the pushed frames unless the stream is paused. if the stream was
+// idle the first gap is timed from now.
+void stream_start(uint32_t stream) {
+    stream_t *st = &streams[stream];
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    if (!st->running && !st->paused) {
+        st->last_sent = timestamp_get();
+        run(st);
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// stop sending, keeping the frames that haven't been sent
+void stream_pause(uint32_t stream) {
+    stream_t *st = &streams[stream];
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    TimerDisable(st->timer_base, TIMER_A);
+    st->running = false;
+    st->paused = true;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// start sending again at speed percent of the original timing, passing
+// over the buffered frames pass_count times or until cleared if 0
+void stream_resume(uint32_t stream, uint32_t speed, uint32_t pass_count) {
+    stream_t *st = &streams[stream];
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    st->speed = speed;
+    st->loops = pass_count;
+    st->paused = false;
+    if (st->loops == 1) {
+        // nothing will be sent again
+        st->base = st->tail;
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    stream_start(stream);
+}
+
+// drop every frame and go back to sending each frame once at the original
+// timing. returns how many frames were still to be sent on this pass.
+uint32_t stream_clear(uint32_t stream) {
+    stream_t *st = &streams[stream];
+    uint32_t unsent;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    unsent = st->head - st->tail;
+    TimerDisable(st->timer_base, TIMER_A);
+    st->running = false;
+    st->paused = false;
+    st->tail = st->head;
+    st->base = st->head;
+    st->loops = 1;
+    st->speed = STREAM_SPEED_NORMAL;
+    st->sent = 0;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return unsent;
+}
+
+void stream_get_status(uint32_t stream, stream_status_t *status) {
+    stream_t *st = &streams[stream];
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    status->buffered = st->head - st->base;
+    status->space = stream_space(stream);
+    status->loops = st->loops;
+    status->speed = st->speed;
+    status->paused = st->paused;
+    status->sent = st->sent;
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
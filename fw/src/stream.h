@@ -0,0 +1,40 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "can.h"
+
+// streams, each with its own buffer and timer so txb frames aren't held
+// back, looped or dropped by the replay
+#define STREAM_REPLAY 0
+#define STREAM_TXB 1
+#define STREAM_COUNT 2
+
+// number of frames each stream holds, must be powers of 2
+#define STREAM_REPLAY_SIZE 64
+#define STREAM_TXB_SIZE 32
+
+// replay speed that keeps the original timing, in percent
+#define STREAM_SPEED_NORMAL 100
+
+typedef struct {
+    // frames waiting to be sent, and frames kept to be sent again
+    uint32_t buffered;
+    uint32_t space;
+    // passes left to send, 0 if looping until stopped
+    uint32_t loops;
+    uint32_t speed;
+    bool paused;
+    // frames sent since the stream was last cleared
+    uint32_t sent;
+} stream_status_t;
+
+void stream_init(void);
+bool stream_push(uint32_t, uint32_t, can_frame_t*, uint32_t);
+void stream_start(uint32_t);
+void stream_pause(uint32_t);
+void stream_resume(uint32_t, uint32_t, uint32_t);
+uint32_t stream_clear(uint32_t);
+uint32_t stream_space(uint32_t);
+void stream_get_status(uint32_t, stream_status_t*);
+
+#endif
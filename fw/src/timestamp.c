@@ -0,0 +1,68 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "inc/hw_ints.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
+
+#include "driverlib/interrupt.h"
+#include "driverlib/rom.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+
+#include "timestamp.h"
+
+// free running microsecond time base
+//
+// wide timer 5 A counts down from 0xFFFFFFFF once per microsecond, and its
+// timeout interrupt extends the count to 64 bits.
+#define TIMESTAMP_BASE WTIMER5_BASE
+#define TIMESTAMP_TICKS_PER_SECOND 1000000
+
+// upper 32 bits of the timestamp
+static volatile uint32_t timestamp_high = 0;
+
+static void timestamp_isr(void) {
+    TimerIntClear(TIMESTAMP_BASE, TIMER_TIMA_TIMEOUT);
+    timestamp_high++;
+}
+
+void timestamp_init(void) {
+    // wait here if the peripherial isn't enabled
+    while (!SysCtlPeripheralReady(SYSCTL_PERIPH_WTIMER5));
+
+    TimerConfigure(TIMESTAMP_BASE, TIMER_CFG_SPLIT_PAIR | TIMER_CFG_A_PERIODIC);
+    // count down so the prescaler divides the clock to 1 MHz
+    TimerPrescaleSet(TIMESTAMP_BASE, TIMER_A,
+                     SysCtlClockGet() / TIMESTAMP_TICKS_PER_SECOND - 1);
+    TimerLoadSet(TIMESTAMP_BASE, TIMER_A, 0xFFFFFFFF);
+
+    TimerIntRegister(TIMESTAMP_BASE, TIMER_A, timestamp_isr);
+    TimerIntEnable(TIMESTAMP_BASE, TIMER_TIMA_TIMEOUT);
+    TimerEnable(TIMESTAMP_BASE, TIMER_A);
+}
+
+// get the time since timestamp_init in microseconds, safe to call from ISRs
+uint64_t timestamp_get(void) {
+    uint32_t high;
+    uint32_t low;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+
+    high = timestamp_high;
+    low = ~TimerValueGet(TIMESTAMP_BASE, TIMER_A);
+    if (TimerIntStatus(TIMESTAMP_BASE, false) & TIMER_TIMA_TIMEOUT) {
+        // the counter wrapped but the overflow interrupt hasn't run yet,
+        // either before or after it was read. reading it again is sure to
+        // give a count from after the wrap.
+        low = ~TimerValueGet(TIMESTAMP_BASE, TIMER_A);
+        high++;
+    }
+
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return ((uint64_t) high << 32) | low;
+}
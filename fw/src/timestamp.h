@@ -0,0 +1,7 @@
+#ifndef _TIMESTAMP_H_
+#define _TIMESTAMP_H_
+
+void timestamp_init(void);
+uint64_t timestamp_get(void);
+
+#endif
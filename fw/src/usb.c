@@ -16,9 +16,13 @@
 
 #include "usb_serial_structs.h"
 #include "usb.h"
+#include "timestamp.h"
 
 #define RX_BUFFER_SIZE 100
 
+// max packet size of the full speed bulk endpoint
+#define USB_PACKET_SIZE 64
+
 // globals
 //
 // indicates if the device is connected
@@ -29,6 +33,19 @@ char *g_pcStatus;
 char cmd_buffer[CMD_BUFFER_SIZE];
 // index for the command buffer
 unsigned int cmd_buffer_index;
+// set when output didn't fit in the transmit buffer, cleared when a packet
+// has been sent and there is space again
+static volatile bool tx_blocked = false;
+// strings dropped because they didn't fit, and writes that had to wait
+static volatile uint32_t tx_dropped = 0;
+static volatile uint32_t tx_stalls = 0;
+// bytes written after the transmit ring's write index but not yet handed
+// to usblib, waiting for a full packet
+static uint32_t tx_pending = 0;
+// when the oldest of those bytes was written
+static uint64_t pending_since;
+// longest time to hold bytes back, in microseconds, 0 to send immediately
+static uint32_t flush_timeout = 0;
 // function pointer to the callback for handling commands
 void (*cmd_callback)(int, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]);
 
@@ -52,19 +69,219 @@ void usb_init(void (*cmd_callback_ptr)(int,
     while (!g_bUSBConfigured);
 }
 
-// send a string to the USB host
-void usb_send_str(char* str) {
-    size_t size;
+// hand bytes written past the ring's write index to usblib for sending.
+// interrupts must be off.
+static void flush_pending(void) {
+    if (tx_pending > 0) {
+        USBBufferDataWritten(&g_sTxBuffer, tx_pending);
+        tx_pending = 0;
+    }
+}
+
+// free space in the transmit buffer after the bytes waiting to be flushed
+static uint32_t space_available(void) {
+    return USBBufferSpaceAvailable(&g_sTxBuffer) - tx_pending;
+}
+
+// get a pointer to size bytes of contiguous free space after any bytes
+// waiting to be flushed, NULL if there isn't room before the end of the
+// buffer. interrupts must be off.
+static uint8_t *contiguous_space(uint32_t size) {
+    tUSBRingBufObject ring;
+    uint32_t write;
+    uint32_t contiguous;
+
+    // bytes waiting to be flushed sit after the write index, and never
+    // wrap around the end of the buffer
+    USBBufferInfoGet(&g_sTxBuffer, &ring);
+    write = ring.ui32WriteIndex + tx_pending;
+    if (write >= ring.ui32ReadIndex) {
+        // free up to the end of the buffer, keeping one byte empty if the
+        // reader is at the start so a full buffer doesn't look empty
+        contiguous = ring.ui32Size - write -
+                     ((ring.ui32ReadIndex == 0) ? 1 : 0);
+    } else {
+        contiguous = ring.ui32ReadIndex - write - 1;
+    }
+
+    if (contiguous < size) {
+        return NULL;
+    }
+    return ring.pui8Buf + write;
+}
+
+// add size bytes written after the pending ones, and send whatever is due.
+// interrupts must be off.
+static void add_pending(uint32_t size) {
+    if (tx_pending == 0) {
+        pending_since = timestamp_get();
+    }
+    tx_pending += size;
+
+    if (flush_timeout == 0) {
+        // low latency: send straight away
+        flush_pending();
+    } else if (tx_pending >= USB_PACKET_SIZE) {
+        // hand over whole packets, keep the rest for the next ones
+        USBBufferDataWritten(&g_sTxBuffer,
+                             tx_pending - (tx_pending % USB_PACKET_SIZE));
+        tx_pending %= USB_PACKET_SIZE;
+        pending_since = timestamp_get();
+    }
+}
+
+// send bytes to the USB host, all or nothing. false if they don't fit in
+// the transmit buffer, the caller can try again once usb_tx_ready.
+bool usb_send(uint8_t *data, uint32_t size) {
+    bool sent = false;
+    bool ints_off;
+    uint8_t *space;
+    uint32_t i;
+
+    // responses are sent from the USB ISR, keep them from landing in the
+    // middle of a record or line sent from the main loop
+    ints_off = ROM_IntMasterDisable();
+    space = (flush_timeout > 0) ? contiguous_space(size) : NULL;
+    if (space != NULL) {
+        // join the bytes waiting for a full packet
+        for (i = 0; i < size; i++) {
+            space[i] = data[i];
+        }
+        add_pending(size);
+        sent = true;
+    } else {
+        // flush first so the output stays in order. a partial write would
+        // split a line or record, so wait for room for all of it instead
+        flush_pending();
+        if (USBBufferSpaceAvailable((tUSBBuffer *)&g_sTxBuffer) >= size) {
+            USBBufferWrite((tUSBBuffer *)&g_sTxBuffer, data, size);
+            sent = true;
+        } else {
+            tx_blocked = true;
+            tx_stalls++;
+        }
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return sent;
+}
+
+// send a string to the USB host, counted as dropped if it doesn't fit
+bool usb_send_str(char* str) {
+    if (!usb_send((uint8_t *)str, ustrlen(str))) {
+        tx_dropped++;
+        return false;
+    }
+    return true;
+}
+
+// interrupt state to restore in usb_tx_commit
+static bool reserve_ints_off;
+
+// get a pointer to size bytes of contiguous free space in the transmit
+// buffer, so output can be written straight into it. NULL if there isn't
+// room before the end of the buffer, the caller can use usb_send instead.
+// interrupts stay off until usb_tx_commit, so nothing else can write to
+// the buffer in the meantime.
+uint8_t *usb_tx_reserve(uint32_t size) {
+    uint8_t *space;
+
+    reserve_ints_off = ROM_IntMasterDisable();
+
+    space = contiguous_space(size);
+    if (space == NULL) {
+        if (space_available() < size) {
+            // full, make sure everything is on its way to the host so
+            // there will be a TX_COMPLETE to resume on
+            flush_pending();
+            tx_blocked = true;
+            tx_stalls++;
+        }
+        if (!reserve_ints_off) {
+            ROM_IntMasterEnable();
+        }
+    }
+
+    return space;
+}
+
+// send size bytes written to the space from usb_tx_reserve. they are held
+// back until there is a full packet, or the flush timeout runs out.
+void usb_tx_commit(uint32_t size) {
+    add_pending(size);
+    if (!reserve_ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// send held back bytes once they have waited the flush timeout, called
+// from the main loop
+void usb_tx_poll(void) {
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    if (tx_pending > 0 && timestamp_get() - pending_since >= flush_timeout) {
+        flush_pending();
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+// set how long output may be held back to fill a packet, in microseconds.
+// 0 sends everything straight away.
+void usb_set_flush_timeout(uint32_t timeout) {
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    flush_timeout = timeout;
+    if (timeout == 0) {
+        flush_pending();
+    }
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+}
+
+uint32_t usb_flush_timeout(void) {
+    return flush_timeout;
+}
 
-    size = ustrlen(str);
-    USBBufferWrite((tUSBBuffer *)&g_sTxBuffer,
-                   (uint8_t *)str, size);
+// true unless output is waiting for the host to read what is buffered
+bool usb_tx_ready(void) {
+    return !tx_blocked;
+}
+
+// bytes that can be written before the transmit buffer is full
+uint32_t usb_tx_space(void) {
+    uint32_t space;
+    bool ints_off;
+
+    ints_off = ROM_IntMasterDisable();
+    space = space_available();
+    if (!ints_off) {
+        ROM_IntMasterEnable();
+    }
+
+    return space;
+}
+
+// number of strings dropped, and of writes that found the buffer full
+uint32_t usb_tx_dropped(void) {
+    return tx_dropped;
+}
+
+uint32_t usb_tx_stalls(void) {
+    return tx_stalls;
 }
 
 // parse the command into its arguments
 static void parse_cmd(char *cmd) {
-    // buffer to store the arguments
-    char args[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE];
+    // buffer to store the arguments. only called from the USB ISR, so it
+    // doesn't need to take up stack space.
+    static char args[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE];
     int arg_count = 0;
     int arg_index = 0;
 
@@ -137,6 +354,12 @@ ControlHandler(void *pvCBData, uint32_t ui32Event,
             //
             USBBufferFlush(&g_sTxBuffer);
             USBBufferFlush(&g_sRxBuffer);
+            // bytes held back for a full packet went with the flush
+            tx_pending = 0;
+
+            // output stalled before a disconnect would otherwise wait for
+            // a TX_COMPLETE that never comes
+            tx_blocked = false;
 
             //
             // Tell the main loop to update the display.
@@ -245,9 +468,10 @@ TxHandler(void *pvCBData, uint32_t ui32Event, uint32_t ui32MsgValue,
     {
         case USB_EVENT_TX_COMPLETE:
             //
-            // Since we are using the USBBuffer, we don't need to do anything
-            // here.
+            // A packet has been sent, so the buffer has room again.  Let the
+            // main loop resume sending.
             //
+            tx_blocked = false;
             break;
 
         //
@@ -319,7 +543,7 @@ RxHandler(void *pvCBData, uint32_t ui32Event, uint32_t ui32MsgValue,
                         cmd_buffer[j] = '\0';
                     }
                     cmd_buffer_index = 0;
-                } else {
+                } else if (cmd_buffer_index < sizeof(cmd_buffer) - 1) {
                     // add the received character to the buffer
                     cmd_buffer[cmd_buffer_index] = rx[i];
                     cmd_buffer_index++;
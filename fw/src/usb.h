@@ -2,15 +2,33 @@
 #define _USB_H_
 
 // input buffer sizes
-#define CMD_BUFFER_SIZE 100
+//
+// a txb line carries up to 10 frames of up to 31 characters each, after
+// the command and the bus
+#define CMD_BUFFER_SIZE 384
 #define CMD_MAX_ARGS 12
-#define CMD_MAX_ARG_SIZE 20
+#define CMD_MAX_ARG_SIZE 32
 
 // maximum size of a response string
-#define MAX_RESP_SIZE 50
+#define MAX_RESP_SIZE 100
+
+// range of the output flush timeout in microseconds, 0 disables holding
+// output back for a full packet
+#define USB_FLUSH_MIN 500
+#define USB_FLUSH_MAX 5000
 
 
 void usb_init(void (*)(int, char argv[CMD_MAX_ARGS][CMD_MAX_ARG_SIZE]));
-void usb_send_str(char* str);
+bool usb_send(uint8_t*, uint32_t);
+bool usb_send_str(char* str);
+bool usb_tx_ready(void);
+uint8_t *usb_tx_reserve(uint32_t);
+void usb_tx_commit(uint32_t);
+uint32_t usb_tx_space(void);
+uint32_t usb_tx_dropped(void);
+uint32_t usb_tx_stalls(void);
+void usb_tx_poll(void);
+void usb_set_flush_timeout(uint32_t);
+uint32_t usb_flush_timeout(void);
 
 #endif
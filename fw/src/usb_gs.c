@@ -0,0 +1,343 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
+
+#include "driverlib/usb.h"
+
+#include "usblib/usblib.h"
+#include "usblib/usb-ids.h"
+#include "usblib/device/usbdevice.h"
+
+#include "can.h"
+#include "timestamp.h"
+#include "gs_usb_proto.h"
+#include "usb_gs.h"
+
+// bulk endpoints, the numbers older gs_usb drivers expect
+#define USB_GS_EP_IN USB_EP_1
+#define USB_GS_EP_OUT USB_EP_2
+#define USB_GS_PACKET_SIZE 64
+
+// string descriptor indices
+enum {
+    USB_GS_STR_MANUFACTURER = 1,
+    USB_GS_STR_PRODUCT,
+    USB_GS_STR_SERIAL,
+    USB_GS_STR_INTERFACE,
+    USB_GS_STR_CONFIG
+};
+
+static const uint8_t device_descriptor[] = {
+    18,                             // bLength
+    USB_DTYPE_DEVICE,
+    USBShort(0x200),                // USB 2.0
+    0,                              // class set by the interface
+    0,
+    0,
+    64,                             // EP0 max packet size
+    USBShort(USB_GS_VID),
+    USBShort(USB_GS_PID),
+    USBShort(0x0100),               // device release
+    USB_GS_STR_MANUFACTURER,
+    USB_GS_STR_PRODUCT,
+    USB_GS_STR_SERIAL,
+    1                               // configurations
+};
+
+static const uint8_t config_descriptor[] = {
+    9,                              // bLength
+    USB_DTYPE_CONFIGURATION,
+    USBShort(9 + 9 + 7 + 7),        // total size of the sections
+    1,                              // interfaces
+    1,                              // bConfigurationValue
+    USB_GS_STR_CONFIG,
+    USB_CONF_ATTR_SELF_PWR,
+    0                               // bMaxPower
+};
+
+// a single vendor specific interface with a bulk endpoint each way
+static const uint8_t interface_descriptor[] = {
+    9,                              // bLength
+    USB_DTYPE_INTERFACE,
+    0,                              // bInterfaceNumber
+    0,                              // bAlternateSetting
+    2,                              // endpoints
+    USB_CLASS_VEND_SPECIFIC,
+    0xFF,
+    0xFF,
+    USB_GS_STR_INTERFACE,
+
+    7,                              // bLength
+    USB_DTYPE_ENDPOINT,
+    USB_EP_DESC_IN | USB_EP_TO_INDEX(USB_GS_EP_IN),
+    USB_EP_ATTR_BULK,
+    USBShort(USB_GS_PACKET_SIZE),
+    0,                              // bInterval
+
+    7,                              // bLength
+    USB_DTYPE_ENDPOINT,
+    USB_EP_DESC_OUT | USB_EP_TO_INDEX(USB_GS_EP_OUT),
+    USB_EP_ATTR_BULK,
+    USBShort(USB_GS_PACKET_SIZE),
+    0                               // bInterval
+};
+
+static const tConfigSection config_section = {
+    sizeof(config_descriptor),
+    config_descriptor
+};
+
+static const tConfigSection interface_section = {
+    sizeof(interface_descriptor),
+    interface_descriptor
+};
+
+static const tConfigSection *config_sections[] = {
+    &config_section,
+    &interface_section
+};
+
+static const tConfigHeader config_header = {
+    sizeof(config_sections) / sizeof(config_sections[0]),
+    config_sections
+};
+
+static const tConfigHeader * const config_descriptors[] = {
+    &config_header
+};
+
+static const uint8_t lang_string[] = {
+    4,
+    USB_DTYPE_STRING,
+    USBShort(USB_LANG_EN_US)
+};
+
+static const uint8_t manufacturer_string[] = {
+    2 + (6 * 2),
+    USB_DTYPE_STRING,
+    's', 0, 'e', 0, 'C', 0, 'A', 0, 'N', 0, 't', 0
+};
+
+static const uint8_t product_string[] = {
+    2 + (13 * 2),
+    USB_DTYPE_STRING,
+    's', 0, 'e', 0, 'C', 0, 'A', 0, 'N', 0, 't', 0, ' ', 0, 'g', 0,
+    's', 0, '_', 0, 'u', 0, 's', 0, 'b', 0
+};
+
+// placeholder serial number, the same as the serial port's. the TM4C123
+// has no unique device id to derive one from, so adapters used together
+// on one host need this changed per board.
+static const uint8_t serial_string[] = {
+    2 + (8 * 2),
+    USB_DTYPE_STRING,
+    '1', 0, '2', 0, '3', 0, '4', 0, '5', 0, '6', 0, '7', 0, '8', 0
+};
+
+static const uint8_t interface_string[] = {
+    2 + (10 * 2),
+    USB_DTYPE_STRING,
+    'g', 0, 's', 0, '_', 0, 'u', 0, 's', 0, 'b', 0, ' ', 0, 'C', 0,
+    'A', 0, 'N', 0
+};
+
+static const uint8_t config_string[] = {
+    2 + (7 * 2),
+    USB_DTYPE_STRING,
+    'D', 0, 'e', 0, 'f', 0, 'a', 0, 'u', 0, 'l', 0, 't', 0
+};
+
+static const uint8_t * const string_descriptors[] = {
+    lang_string,
+    manufacturer_string,
+    product_string,
+    serial_string,
+    interface_string,
+    config_string
+};
+
+static void handle_request(void*, tUSBRequest*);
+static void handle_config(void*, uint32_t);
+static void handle_data(void*, uint32_t);
+static void handle_reset(void*);
+
+static const tCustomHandlers handlers = {
+    0,                              // pfnGetDescriptor
+    handle_request,                 // pfnRequestHandler
+    0,                              // pfnInterfaceChange
+    handle_config,                  // pfnConfigChange
+    handle_data,                    // pfnDataReceived
+    0,                              // pfnDataSent
+    handle_reset,                   // pfnResetHandler
+    0,                              // pfnSuspendHandler
+    0,                              // pfnResumeHandler
+    handle_reset,                   // pfnDisconnectHandler
+    0,                              // pfnEndpointHandler
+    0                               // pfnDeviceHandler
+};
+
+static tDeviceInfo device_info = {
+    &handlers,
+    device_descriptor,
+    config_descriptors,
+    string_descriptors,
+    sizeof(string_descriptors) / sizeof(string_descriptors[0])
+};
+
+// set while the host has the device configured
+static volatile bool configured = false;
+
+// data stage of the control request being handled
+static uint8_t control_buf[GS_USB_CONTROL_SIZE];
+static uint32_t control_request;
+static uint32_t control_channel;
+
+// frame from the host, held until it is in the transmit queue and echoed.
+// the next one stays in the endpoint until then, which holds the host off
+// while the bus is busy.
+static uint8_t packet[USB_GS_PACKET_SIZE];
+static bool out_held = false;
+static bool echo_waiting = false;
+static uint32_t out_bus;
+static uint32_t out_echo_id;
+static can_frame_t out_frame;
+
+// vendor requests on endpoint 0, from the USB ISR
+static void handle_request(void *instance, tUSBRequest *request) {
+    uint32_t size;
+
+    if ((request->bmRequestType & USB_RTYPE_TYPE_M) != USB_RTYPE_VENDOR) {
+        USBDCDStallEP0(0);
+        return;
+    }
+
+    if (request->bmRequestType & USB_RTYPE_DIR_IN) {
+        size = gs_usb_control_in(request->bRequest, request->wValue,
+                                 control_buf);
+        if (size == 0) {
+            USBDCDStallEP0(0);
+            return;
+        }
+        if (size > request->wLength) {
+            size = request->wLength;
+        }
+        USBDevEndpointDataAck(USB0_BASE, USB_EP_0, false);
+        USBDCDSendDataEP0(0, control_buf, size);
+    } else {
+        // settings can't be refused once their data has arrived, so check
+        // what the host is about to send first
+        size = gs_usb_control_out_size(request->bRequest, request->wValue);
+        if (size == 0 || size != request->wLength) {
+            USBDCDStallEP0(0);
+            return;
+        }
+        control_request = request->bRequest;
+        control_channel = request->wValue;
+        USBDCDRequestDataEP0(0, control_buf, size);
+        USBDevEndpointDataAck(USB0_BASE, USB_EP_0, false);
+    }
+}
+
+// the data stage of a host to device request has arrived
+static void handle_data(void *instance, uint32_t size) {
+    gs_usb_control_out(control_request, control_channel, control_buf);
+}
+
+static void handle_config(void *instance, uint32_t value) {
+    configured = true;
+}
+
+// bus reset or disconnect, the host has to set everything up again
+static void handle_reset(void *instance) {
+    configured = false;
+    gs_usb_reset();
+}
+
+void usb_gs_init(void) {
+    // set USB mode to force device. will always be devices regardless of
+    // hardware
+    USBStackModeSet(0, eUSBModeForceDevice, 0);
+
+    USBDCDInit(0, &device_info, 0);
+
+    // wait for USB to initialize
+    while (!configured);
+}
+
+// true if a packet can be loaded into the IN endpoint
+static bool in_free(void) {
+    return !(USBEndpointStatus(USB0_BASE, USB_GS_EP_IN) & USB_DEV_TX_TXPKTRDY);
+}
+
+static void send_packet(uint8_t *data, uint32_t size) {
+    USBEndpointDataPut(USB0_BASE, USB_GS_EP_IN, data, size);
+    USBEndpointDataSend(USB0_BASE, USB_GS_EP_IN, USB_TRANS_IN);
+}
+
+// move frames from the host to the transmit queues, called from the main
+// loop
+//
+// the host expects each frame it sends to come back with its echo id, and
+// stops sending when too many are outstanding. frames are echoed once they
+// are queued.
+void usb_gs_poll(void) {
+    uint32_t size;
+
+    if (!configured) {
+        out_held = false;
+        echo_waiting = false;
+        return;
+    }
+
+    // take the next frame from the host
+    if (!out_held &&
+        (USBEndpointStatus(USB0_BASE, USB_GS_EP_OUT) & USB_DEV_RX_PKT_RDY)) {
+        size = sizeof(packet);
+        USBEndpointDataGet(USB0_BASE, USB_GS_EP_OUT, packet, &size);
+        USBDevEndpointDataAck(USB0_BASE, USB_GS_EP_OUT, true);
+        out_held = gs_usb_unpack_frame(packet, size, &out_bus, &out_frame,
+                                       &out_echo_id);
+        // like received frames, frames for buses the host hasn't started
+        // are dropped and not echoed
+        if (out_held && !gs_usb_started(out_bus)) {
+            out_held = false;
+        }
+    }
+
+    // queue it, checking for space first so waiting isn't counted as
+    // frames lost
+    if (out_held && !echo_waiting && can_tx_space(out_bus) > 0 &&
+        can_send_frame(out_bus, &out_frame)) {
+        out_frame.timestamp = timestamp_get();
+        echo_waiting = true;
+    }
+
+    // and echo it, ahead of received frames
+    if (echo_waiting && in_free()) {
+        size = gs_usb_pack_frame(packet, out_bus, &out_frame, out_echo_id);
+        send_packet(packet, size);
+        echo_waiting = false;
+        out_held = false;
+    }
+}
+
+// send a frame received on bus to the host. false if it has to wait, frames
+// from buses the host hasn't started are dropped.
+bool usb_gs_send(uint32_t bus, can_frame_t *frame) {
+    uint8_t buf[GS_USB_FRAME_TS_SIZE];
+    uint32_t size;
+
+    if (!configured || echo_waiting || !in_free()) {
+        return false;
+    }
+    if (!gs_usb_started(bus)) {
+        return true;
+    }
+
+    size = gs_usb_pack_frame(buf, bus, frame, GS_USB_ECHO_RX);
+    send_packet(buf, size);
+
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef _USB_GS_H_
+#define _USB_GS_H_
+
+#include "can.h"
+
+// gs_usb personality, enumerating as a candleLight adapter so the Linux
+// gs_usb driver makes both buses SocketCAN interfaces. built in place of
+// the serial port with GS_USB defined.
+#define USB_GS_VID 0x1D50
+#define USB_GS_PID 0x606F
+
+void usb_gs_init(void);
+void usb_gs_poll(void);
+bool usb_gs_send(uint32_t, can_frame_t*);
+
+#endif
@@ -199,7 +199,7 @@ const tUSBBuffer g_sRxBuffer =
 // Transmit buffer (from the USB perspective).
 //
 //*****************************************************************************
-uint8_t g_pui8USBTxBuffer[UART_BUFFER_SIZE];
+uint8_t g_pui8USBTxBuffer[USB_TX_BUFFER_SIZE];
 uint8_t g_pui8TxBufferWorkspace[USB_BUFFER_WORKSPACE_SIZE];
 const tUSBBuffer g_sTxBuffer =
 {
@@ -210,6 +210,6 @@ const tUSBBuffer g_sTxBuffer =
     USBDCDCTxPacketAvailable,       // pfnAvailable
     (void *)&g_sCDCDevice,          // pvHandle
     g_pui8USBTxBuffer,              // pui8Buffer
-    UART_BUFFER_SIZE,               // ui32BufferSize
+    USB_TX_BUFFER_SIZE,             // ui32BufferSize
     g_pui8TxBufferWorkspace         // pvWorkspace
 };
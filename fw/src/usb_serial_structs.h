@@ -35,6 +35,14 @@
 //*****************************************************************************
 #define UART_BUFFER_SIZE 256
 
+//*****************************************************************************
+//
+// The size of the transmit buffer.  Output is staged here while the host is
+// slow to read it, so it is as large as the RAM budget allows.
+//
+//*****************************************************************************
+#define USB_TX_BUFFER_SIZE 2048
+
 extern uint32_t RxHandler(void *pvCBData, uint32_t ui32Event,
                           uint32_t ui32MsgValue, void *pvMsgData);
 extern uint32_t TxHandler(void *pvi32CBData, uint32_t ui32Event,